@@ -0,0 +1,223 @@
+#include "admission.h"
+#include "config.h"
+#include "gui.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+static long max_connections, hard_connections, max_upstream, max_pending_bytes, max_queued;
+static long queue_timeout_ms, retry_after_sec;
+
+typedef struct {
+    long active_connections;
+    long inflight_upstream;
+    long queued_upstream;
+    long pending_bytes;
+    unsigned long accepted;
+    unsigned long hits_only_admitted;
+    unsigned long rejected_at_accept;
+    unsigned long spawn_failures;
+    unsigned long shed_hits_only;
+    unsigned long upstream_queued;
+    unsigned long shed_queue_full;
+    unsigned long shed_queue_timeout;
+    unsigned long cache_skipped;
+} AdmissionStats;
+
+static AdmissionStats stats;
+static time_t last_logged = 0;
+static pthread_mutex_t admission_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t upstream_cond;
+
+void admission_init(void) {
+    max_connections = config_long("PROXY_MAX_CONNECTIONS", 512);
+    hard_connections = config_long("PROXY_HARD_CONNECTIONS", max_connections * 2);
+    if (hard_connections < max_connections) hard_connections = max_connections;
+    max_upstream = config_long("PROXY_MAX_UPSTREAM", 128);
+    max_pending_bytes = config_long("PROXY_MAX_PENDING_BYTES", 64L * 1024 * 1024);
+    max_queued = config_long("PROXY_MAX_QUEUED", 256);
+    queue_timeout_ms = config_long("PROXY_QUEUE_TIMEOUT_MS", 2000);
+    retry_after_sec = config_long("PROXY_RETRY_AFTER", 1);
+
+    // Queue deadlines are measured on the monotonic clock
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&upstream_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    printf("[ADMISSION] connections %ld/%ld, upstream %ld, pending bytes %ld, queue %ld x %ld ms\n",
+           max_connections, hard_connections, max_upstream, max_pending_bytes, max_queued, queue_timeout_ms);
+}
+
+// Report the counters at most once a second, and only while shedding
+static void log_shedding(void) {
+    char message[512];
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&admission_mutex);
+    if (now == last_logged) {
+        pthread_mutex_unlock(&admission_mutex);
+        return;
+    }
+    last_logged = now;
+    snprintf(message, sizeof(message),
+             "[ADMISSION] active=%ld inflight=%ld queued=%ld pending=%ld | accepted=%lu rejected=%lu "
+             "hits_only=%lu shed_hits_only=%lu upstream_queued=%lu queue_full=%lu queue_timeout=%lu "
+             "spawn_fail=%lu cache_skipped=%lu",
+             stats.active_connections, stats.inflight_upstream, stats.queued_upstream, stats.pending_bytes,
+             stats.accepted, stats.rejected_at_accept, stats.hits_only_admitted, stats.shed_hits_only,
+             stats.upstream_queued, stats.shed_queue_full, stats.shed_queue_timeout, stats.spawn_failures,
+             stats.cache_skipped);
+    pthread_mutex_unlock(&admission_mutex);
+
+    printf("%s\n", message);
+    char *msg = strdup(message);
+    if (msg) g_idle_add(log_message_idle, msg);
+}
+
+Admission admission_enter_connection(void) {
+    Admission result;
+    pthread_mutex_lock(&admission_mutex);
+    if (stats.active_connections >= hard_connections) {
+        stats.rejected_at_accept++;
+        result = ADMIT_REJECT;
+    } else {
+        stats.active_connections++;
+        stats.accepted++;
+        result = ADMIT_FULL;
+        if (stats.active_connections > max_connections) {
+            stats.hits_only_admitted++;
+            result = ADMIT_HITS_ONLY;
+        }
+    }
+    pthread_mutex_unlock(&admission_mutex);
+
+    if (result == ADMIT_REJECT) log_shedding();
+    return result;
+}
+
+void admission_leave_connection(void) {
+    pthread_mutex_lock(&admission_mutex);
+    stats.active_connections--;
+    pthread_mutex_unlock(&admission_mutex);
+}
+
+static int upstream_available(void) {
+    return stats.inflight_upstream < max_upstream && stats.pending_bytes < max_pending_bytes;
+}
+
+// Take an origin fetch slot, waiting in a bounded queue until the deadline.
+// Returns 0 when admitted and -1 when the request should be shed.
+int admission_acquire_upstream(void) {
+    pthread_mutex_lock(&admission_mutex);
+    if (upstream_available()) {
+        stats.inflight_upstream++;
+        pthread_mutex_unlock(&admission_mutex);
+        return 0;
+    }
+    if (stats.queued_upstream >= max_queued) {
+        stats.shed_queue_full++;
+        pthread_mutex_unlock(&admission_mutex);
+        log_shedding();
+        return -1;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += queue_timeout_ms / 1000;
+    deadline.tv_nsec += (queue_timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    stats.queued_upstream++;
+    stats.upstream_queued++;
+    while (!upstream_available()) {
+        if (pthread_cond_timedwait(&upstream_cond, &admission_mutex, &deadline) == ETIMEDOUT &&
+            !upstream_available()) {
+            stats.queued_upstream--;
+            stats.shed_queue_timeout++;
+            pthread_mutex_unlock(&admission_mutex);
+            log_shedding();
+            return -1;
+        }
+    }
+    stats.queued_upstream--;
+    stats.inflight_upstream++;
+    pthread_mutex_unlock(&admission_mutex);
+    return 0;
+}
+
+// Take a slot for background work without waiting. It is refused whenever
+// a client would be held back: above the soft connection limit, where
+// clients are served hits only, or with misses already queued.
+int admission_try_acquire_upstream(void) {
+    int rc = -1;
+    pthread_mutex_lock(&admission_mutex);
+    if (stats.active_connections <= max_connections && stats.queued_upstream == 0 &&
+        upstream_available()) {
+        stats.inflight_upstream++;
+        rc = 0;
+    }
+    pthread_mutex_unlock(&admission_mutex);
+    return rc;
+}
+
+void admission_release_upstream(void) {
+    pthread_mutex_lock(&admission_mutex);
+    stats.inflight_upstream--;
+    pthread_cond_signal(&upstream_cond);
+    pthread_mutex_unlock(&admission_mutex);
+}
+
+// Account response bytes held for the cache; -1 means the budget is spent
+int admission_reserve_bytes(size_t n) {
+    int rc = 0;
+    pthread_mutex_lock(&admission_mutex);
+    if (stats.pending_bytes + (long)n > max_pending_bytes) rc = -1;
+    else stats.pending_bytes += n;
+    pthread_mutex_unlock(&admission_mutex);
+    return rc;
+}
+
+void admission_release_bytes(size_t n) {
+    if (n == 0) return;
+    pthread_mutex_lock(&admission_mutex);
+    stats.pending_bytes -= n;
+    pthread_cond_broadcast(&upstream_cond);
+    pthread_mutex_unlock(&admission_mutex);
+}
+
+void admission_count_spawn_failure(void) {
+    pthread_mutex_lock(&admission_mutex);
+    stats.spawn_failures++;
+    pthread_mutex_unlock(&admission_mutex);
+    log_shedding();
+}
+
+void admission_count_shed_hits_only(void) {
+    pthread_mutex_lock(&admission_mutex);
+    stats.shed_hits_only++;
+    pthread_mutex_unlock(&admission_mutex);
+    log_shedding();
+}
+
+void admission_count_cache_skipped(void) {
+    pthread_mutex_lock(&admission_mutex);
+    stats.cache_skipped++;
+    pthread_mutex_unlock(&admission_mutex);
+}
+
+void admission_send_503(int fd) {
+    char response[128];
+    int len = snprintf(response, sizeof(response),
+                       "HTTP/1.1 503 Service Unavailable\r\nRetry-After: %ld\r\n"
+                       "Content-Length: 0\r\nConnection: close\r\n\r\n", retry_after_sec);
+    send(fd, response, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
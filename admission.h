@@ -0,0 +1,36 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stddef.h>
+
+// Limits, from the environment:
+//   PROXY_MAX_CONNECTIONS    connections served normally (default 512)
+//   PROXY_HARD_CONNECTIONS   beyond this, reject at accept (default 2x max)
+//   PROXY_MAX_UPSTREAM       concurrent origin fetches (default 128)
+//   PROXY_MAX_PENDING_BYTES  response bytes buffered for the cache (default 64 MB)
+//   PROXY_MAX_QUEUED         misses waiting for an upstream slot (default 256)
+//   PROXY_QUEUE_TIMEOUT_MS   how long a queued miss may wait (default 2000)
+//   PROXY_RETRY_AFTER        Retry-After seconds on 503 (default 1)
+//
+// Between the soft and hard connection limits a connection is admitted in
+// hits-only mode: it is served from the cache or shed with a 503.
+typedef enum {
+    ADMIT_FULL,
+    ADMIT_HITS_ONLY,
+    ADMIT_REJECT
+} Admission;
+
+void admission_init(void);
+Admission admission_enter_connection(void);
+void admission_leave_connection(void);
+int admission_acquire_upstream(void);
+int admission_try_acquire_upstream(void);
+void admission_release_upstream(void);
+int admission_reserve_bytes(size_t n);
+void admission_release_bytes(size_t n);
+void admission_count_spawn_failure(void);
+void admission_count_shed_hits_only(void);
+void admission_count_cache_skipped(void);
+void admission_send_503(int fd);
+
+#endif
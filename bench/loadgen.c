@@ -0,0 +1,342 @@
+// Multi-threaded load generator that drives GET, POST and CONNECT through the proxy.
+//
+// Usage: loadgen [-P proxy_port] [-O origin_port] [-c threads] [-n requests | -d seconds]
+//                [-m get:post:connect] [-h hit_ratio] [-k hot_set] [-x proxy_pid]
+//   -P  proxy port on 127.0.0.1 (default 8080)
+//   -O  origin stub port on 127.0.0.1 (default 9090)
+//   -c  concurrent client threads (default 16)
+//   -n  total number of requests (default 10000)
+//   -d  run for a fixed number of seconds instead of -n
+//   -m  relative weights of GET, POST and CONNECT requests (default 100:0:0)
+//   -h  fraction of GET/POST requests drawn from the hot set (default 0.8)
+//   -k  size of the hot set of URLs (default 8, keep it below CACHE_SIZE)
+//   -x  pid of the proxy, to report its CPU usage over the run
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+
+#define BUFFER_SIZE 16384
+
+enum { REQ_GET, REQ_POST, REQ_CONNECT, REQ_KINDS };
+static const char *kind_names[REQ_KINDS] = { "GET", "POST", "CONNECT" };
+
+static int proxy_port = 8080;
+static int origin_port = 9090;
+static int num_threads = 16;
+static long total_requests = 10000;
+static int duration_sec = 0;
+static int weights[REQ_KINDS] = { 100, 0, 0 };
+static double hit_ratio = 0.8;
+static int hot_set = 8;
+static int proxy_pid = 0;
+
+static long next_request = 0;
+static long next_unique = 0;
+static volatile int stop_flag = 0;
+
+typedef struct {
+    double *lat_us[REQ_KINDS];
+    size_t count[REQ_KINDS];
+    size_t cap[REQ_KINDS];
+    long errors;
+    long long bytes;
+    unsigned int seed;
+} ThreadStats;
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-P proxy_port] [-O origin_port] [-c threads] [-n requests | -d seconds]\n"
+                    "          [-m get:post:connect] [-h hit_ratio] [-k hot_set] [-x proxy_pid]\n", prog);
+    exit(1);
+}
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void record(ThreadStats *st, int kind, double us) {
+    if (st->count[kind] == st->cap[kind]) {
+        size_t new_cap = st->cap[kind] ? st->cap[kind] * 2 : 1024;
+        double *p = realloc(st->lat_us[kind], new_cap * sizeof(double));
+        if (!p) return;
+        st->lat_us[kind] = p;
+        st->cap[kind] = new_cap;
+    }
+    st->lat_us[kind][st->count[kind]++] = us;
+}
+
+static int connect_local(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n <= 0) return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Read until the peer closes; returns bytes read or -1 unless the status is 200
+static long read_response(int fd) {
+    char buf[BUFFER_SIZE];
+    long total = 0;
+    int status_ok = -1;
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+        if (status_ok < 0 && total == 0 && n >= 12) {
+            status_ok = strncmp(buf, "HTTP/1.", 7) == 0 && strncmp(buf + 9, "200", 3) == 0;
+        }
+        total += n;
+    }
+    return status_ok == 1 ? total : -1;
+}
+
+// Read the proxy's reply to CONNECT up to and including the blank line
+static int read_connect_reply(int fd) {
+    char buf[512];
+    size_t len = 0;
+    while (len < sizeof(buf) - 1) {
+        ssize_t n = recv(fd, buf + len, 1, 0);
+        if (n <= 0) return -1;
+        len += n;
+        buf[len] = '\0';
+        if (len >= 4 && strcmp(buf + len - 4, "\r\n\r\n") == 0) {
+            return strncmp(buf + 9, "200", 3) == 0 ? 0 : -1;
+        }
+    }
+    return -1;
+}
+
+static long do_request(ThreadStats *st, int kind) {
+    char req[1024];
+    char path[64];
+    int len;
+
+    if ((double)rand_r(&st->seed) / RAND_MAX < hit_ratio) {
+        snprintf(path, sizeof(path), "/hot/%d", rand_r(&st->seed) % hot_set);
+    } else {
+        snprintf(path, sizeof(path), "/miss/%ld", __sync_fetch_and_add(&next_unique, 1));
+    }
+
+    int fd = connect_local(proxy_port);
+    if (fd < 0) return -1;
+
+    long result = -1;
+    switch (kind) {
+    case REQ_GET:
+        len = snprintf(req, sizeof(req),
+                       "GET http://127.0.0.1:%d%s HTTP/1.1\r\nHost: 127.0.0.1:%d\r\n"
+                       "User-Agent: loadgen\r\nConnection: close\r\n\r\n",
+                       origin_port, path, origin_port);
+        if (send_all(fd, req, len) == 0) result = read_response(fd);
+        break;
+    case REQ_POST:
+        len = snprintf(req, sizeof(req),
+                       "POST http://127.0.0.1:%d/post HTTP/1.1\r\nHost: 127.0.0.1:%d\r\n"
+                       "Content-Type: application/x-www-form-urlencoded\r\n"
+                       "Content-Length: %zu\r\nConnection: close\r\n\r\nq=%s",
+                       origin_port, origin_port, strlen(path) + 2, path);
+        if (send_all(fd, req, len) == 0) result = read_response(fd);
+        break;
+    case REQ_CONNECT:
+        len = snprintf(req, sizeof(req), "CONNECT 127.0.0.1:%d HTTP/1.1\r\nHost: 127.0.0.1:%d\r\n\r\n",
+                       origin_port, origin_port);
+        if (send_all(fd, req, len) == 0 && read_connect_reply(fd) == 0) {
+            len = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: 127.0.0.1:%d\r\nConnection: close\r\n\r\n",
+                           path, origin_port);
+            if (send_all(fd, req, len) == 0) result = read_response(fd);
+        }
+        break;
+    }
+    close(fd);
+    return result;
+}
+
+static int pick_kind(ThreadStats *st) {
+    int sum = weights[REQ_GET] + weights[REQ_POST] + weights[REQ_CONNECT];
+    int r = rand_r(&st->seed) % sum;
+    if (r < weights[REQ_GET]) return REQ_GET;
+    if (r < weights[REQ_GET] + weights[REQ_POST]) return REQ_POST;
+    return REQ_CONNECT;
+}
+
+static void *worker(void *arg) {
+    ThreadStats *st = arg;
+    while (!stop_flag) {
+        if (!duration_sec && __sync_fetch_and_add(&next_request, 1) >= total_requests) break;
+        int kind = pick_kind(st);
+        double start = now_us();
+        long bytes = do_request(st, kind);
+        double elapsed = now_us() - start;
+        if (bytes < 0) {
+            st->errors++;
+            continue;
+        }
+        st->bytes += bytes;
+        record(st, kind, elapsed);
+    }
+    return NULL;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const double *sorted, size_t n, double p) {
+    if (n == 0) return 0;
+    size_t idx = (size_t)(p * (n - 1) + 0.5);
+    return sorted[idx];
+}
+
+static void print_latency(const char *label, double *lat, size_t n) {
+    qsort(lat, n, sizeof(double), cmp_double);
+    printf("%-10s n=%-8zu p50 %8.3f ms  p99 %8.3f ms  p999 %8.3f ms  max %8.3f ms\n",
+           label, n,
+           percentile(lat, n, 0.50) / 1000, percentile(lat, n, 0.99) / 1000,
+           percentile(lat, n, 0.999) / 1000, n ? lat[n - 1] / 1000 : 0);
+}
+
+// utime + stime of a process in seconds, from /proc/<pid>/stat
+static double process_cpu_sec(int pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    char line[1024];
+    double result = -1;
+    if (fgets(line, sizeof(line), f)) {
+        char *p = strrchr(line, ')');
+        unsigned long utime, stime;
+        // Fields after the command name start at field 3 (state); utime/stime are 14 and 15
+        if (p && sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) == 2) {
+            result = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+        }
+    }
+    fclose(f);
+    return result;
+}
+
+static double self_cpu_sec(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "P:O:c:n:d:m:h:k:x:")) != -1) {
+        switch (opt) {
+        case 'P': proxy_port = atoi(optarg); break;
+        case 'O': origin_port = atoi(optarg); break;
+        case 'c': num_threads = atoi(optarg); break;
+        case 'n': total_requests = atol(optarg); break;
+        case 'd': duration_sec = atoi(optarg); break;
+        case 'm':
+            if (sscanf(optarg, "%d:%d:%d", &weights[0], &weights[1], &weights[2]) != 3 ||
+                weights[0] + weights[1] + weights[2] <= 0) usage(argv[0]);
+            break;
+        case 'h': hit_ratio = atof(optarg); break;
+        case 'k': hot_set = atoi(optarg); break;
+        case 'x': proxy_pid = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (num_threads <= 0 || hot_set <= 0) usage(argv[0]);
+    signal(SIGPIPE, SIG_IGN);
+
+    ThreadStats *stats = calloc(num_threads, sizeof(ThreadStats));
+    pthread_t *threads = calloc(num_threads, sizeof(pthread_t));
+    if (!stats || !threads) return 1;
+
+    double proxy_cpu_start = proxy_pid ? process_cpu_sec(proxy_pid) : -1;
+    double self_cpu_start = self_cpu_sec();
+    double start = now_us();
+
+    for (int i = 0; i < num_threads; i++) {
+        stats[i].seed = 12345 + i;
+        pthread_create(&threads[i], NULL, worker, &stats[i]);
+    }
+    if (duration_sec) {
+        sleep(duration_sec);
+        stop_flag = 1;
+    }
+    for (int i = 0; i < num_threads; i++) pthread_join(threads[i], NULL);
+
+    double wall_sec = (now_us() - start) / 1e6;
+    double self_cpu = self_cpu_sec() - self_cpu_start;
+    double proxy_cpu = proxy_pid ? process_cpu_sec(proxy_pid) - proxy_cpu_start : -1;
+
+    // Merge per-thread samples
+    size_t n_all = 0, n_kind[REQ_KINDS] = { 0 };
+    long errors = 0;
+    long long bytes = 0;
+    for (int i = 0; i < num_threads; i++) {
+        for (int k = 0; k < REQ_KINDS; k++) n_kind[k] += stats[i].count[k];
+        errors += stats[i].errors;
+        bytes += stats[i].bytes;
+    }
+    for (int k = 0; k < REQ_KINDS; k++) n_all += n_kind[k];
+
+    double *all = malloc((n_all + 1) * sizeof(double));
+    double *by_kind[REQ_KINDS];
+    size_t pos_all = 0;
+    for (int k = 0; k < REQ_KINDS; k++) {
+        by_kind[k] = malloc((n_kind[k] + 1) * sizeof(double));
+        size_t pos = 0;
+        for (int i = 0; i < num_threads; i++) {
+            memcpy(by_kind[k] + pos, stats[i].lat_us[k], stats[i].count[k] * sizeof(double));
+            memcpy(all + pos_all, stats[i].lat_us[k], stats[i].count[k] * sizeof(double));
+            pos += stats[i].count[k];
+            pos_all += stats[i].count[k];
+        }
+    }
+
+    printf("threads    %d, mix GET:POST:CONNECT %d:%d:%d, hit ratio %.2f, hot set %d\n",
+           num_threads, weights[0], weights[1], weights[2], hit_ratio, hot_set);
+    printf("requests   %zu ok, %ld errors in %.2f s\n", n_all, errors, wall_sec);
+    printf("throughput %.1f req/s, %.2f MB/s\n", n_all / wall_sec, bytes / wall_sec / (1024 * 1024));
+    print_latency("all", all, n_all);
+    for (int k = 0; k < REQ_KINDS; k++) {
+        if (n_kind[k]) print_latency(kind_names[k], by_kind[k], n_kind[k]);
+    }
+    printf("cpu        loadgen %.1f%%", 100 * self_cpu / wall_sec);
+    if (proxy_cpu >= 0) printf("  proxy %.1f%%", 100 * proxy_cpu / wall_sec);
+    printf(" (of one core)\n");
+
+    free(all);
+    for (int k = 0; k < REQ_KINDS; k++) free(by_kind[k]);
+    for (int i = 0; i < num_threads; i++) {
+        for (int k = 0; k < REQ_KINDS; k++) free(stats[i].lat_us[k]);
+    }
+    free(stats);
+    free(threads);
+    return errors ? 2 : 0;
+}
@@ -0,0 +1,404 @@
+// Microbenchmarks for the cache, cache key building, host blocking, request
+// parsing, response header scanning and per-connection buffer allocation.
+//
+// Usage: micro [-t max_threads] [-s scale]
+//   -t  highest thread count of the scaling curve, doubling from 1 (default 8)
+//   -s  multiply the iteration counts by this factor (default 1)
+//
+// Linked against the same objects as the proxy binary. malloc and friends are
+// wrapped at link time (see MICRO_WRAP in the makefile) so allocations made by
+// proxy code can be counted per operation, together with the size-class blocks
+// pool_alloc hands out. Each case is run several times and the median is
+// reported, one line per (case, threads), so runs can be diffed.
+#include "cache.h"
+#include "proxy.h"
+#include "request.h"
+#include "scan.h"
+#include "pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define REPEATS 5
+#define RESPONSE_SIZE 4096
+#define SLOW_HEADERS 120
+#define RELAY_CHUNK 512
+#define CONN_COUNT 10000
+#define CONN_RECV 8192
+
+static __thread unsigned long thread_allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+char *__real_strdup(const char *s);
+
+void *__wrap_malloc(size_t size) { thread_allocs++; return __real_malloc(size); }
+void *__wrap_calloc(size_t n, size_t size) { thread_allocs++; return __real_calloc(n, size); }
+void *__wrap_realloc(void *p, size_t size) { thread_allocs++; return __real_realloc(p, size); }
+char *__wrap_strdup(const char *s) { thread_allocs++; return __real_strdup(s); }
+
+typedef void (*bench_fn)(long iters, int tid);
+
+typedef struct {
+    bench_fn fn;
+    long iters;
+    int tid;
+    pthread_barrier_t *barrier;
+    unsigned long allocs;
+} Worker;
+
+static const char *urls[] = {
+    "http://www.example.com/",
+    "http://cdn.example.com/static/js/app.3f9a1c7e.min.js",
+    "http://api.example.com/v2/users/12345/orders?page=3&limit=50&sort=desc",
+    "http://images.example.org:8080/photos/2024/10/18/IMG_0042.jpg?w=640&h=480",
+    "http://news.example.net/world/europe/a-fairly-long-article-slug-written-for-search-engines",
+    "www.example.com/index.html",
+};
+#define NUM_URLS (sizeof(urls) / sizeof(urls[0]))
+
+static const char *hosts[] = {
+    "www.google.com",
+    "cdn.jsdelivr.net",
+    "www.wikipedia.org",
+    "api.github.com",
+    "example-bad-site.com",
+    "static.cloudflareinsights.com",
+};
+#define NUM_HOSTS (sizeof(hosts) / sizeof(hosts[0]))
+
+static const char *requests[] = {
+    "GET http://www.example.com/index.html HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Connection: keep-alive\r\n\r\n",
+    "POST http://api.example.com/v2/login HTTP/1.1\r\n"
+    "Host: api.example.com\r\n"
+    "Content-Type: application/x-www-form-urlencoded\r\n"
+    "Content-Length: 29\r\n\r\n"
+    "user=alice&password=hunter2&x",
+    "CONNECT www.example.com:443 HTTP/1.1\r\n"
+    "Host: www.example.com:443\r\n"
+    "Proxy-Connection: keep-alive\r\n\r\n",
+};
+#define NUM_REQUESTS (sizeof(requests) / sizeof(requests[0]))
+static size_t request_lengths[NUM_REQUESTS];
+
+static char slow_response[16384];
+static size_t slow_response_len;
+static char cache_keys[16][64];
+static char cached_response[RESPONSE_SIZE];
+static volatile int sink;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Lookup, and insert on a miss, over a key set of the given size
+static void cache_ops(long iters, int tid, int num_keys) {
+    for (long i = 0; i < iters; i++) {
+        const char *key = cache_keys[(i * 7 + tid) % num_keys];
+        char *resp = find_in_cache(key, NULL, NULL);
+        if (resp) {
+            pool_free(resp);
+        } else {
+            add_to_cache(key, cached_response);
+        }
+    }
+}
+
+static void bench_cache_hit(long iters, int tid) { cache_ops(iters, tid, 8); }
+static void bench_cache_mixed(long iters, int tid) { cache_ops(iters, tid, 16); }
+
+static void bench_cache_key(long iters, int tid) {
+    char key[16384];
+    for (long i = 0; i < iters; i++) {
+        const char *url = urls[(i + tid) % NUM_URLS];
+        if (i & 1) {
+            build_cache_key("POST", url, "user=alice&password=hunter2", key, sizeof(key));
+        } else {
+            build_cache_key("GET", url, NULL, key, sizeof(key));
+        }
+        sink += key[0];
+    }
+}
+
+static void bench_is_blocked(long iters, int tid) {
+    for (long i = 0; i < iters; i++) {
+        sink += is_blocked(hosts[(i + tid) % NUM_HOSTS]);
+    }
+}
+
+static void bench_parse_request(long iters, int tid) {
+    HttpRequest req;
+    for (long i = 0; i < iters; i++) {
+        // The parser only reads the buffer, so it can point at the literal directly
+        const char *r = requests[(i + tid) % NUM_REQUESTS];
+        size_t len = request_lengths[(i + tid) % NUM_REQUESTS];
+        request_init(&req, (char *)r, len);
+        req.len = len;
+        if (request_parse(&req) == REQ_COMPLETE) {
+            sink += req.num_headers;
+        }
+    }
+}
+
+// Accumulate a response with a large header block in small chunks, looking
+// for the end of the headers after every chunk the way the relay loop does
+static void bench_header_end_strstr(long iters, int tid) {
+    char acc[sizeof(slow_response) + 1];
+    for (long i = 0; i < iters; i++) {
+        size_t offset = 0;
+        while (offset < slow_response_len) {
+            size_t n = slow_response_len - offset < RELAY_CHUNK ? slow_response_len - offset : RELAY_CHUNK;
+            memcpy(acc + offset, slow_response + offset, n);
+            offset += n;
+            acc[offset] = '\0';
+            if (strstr(acc, "\r\n\r\n")) break;
+        }
+        sink += offset;
+    }
+}
+
+static void bench_header_end_scan(long iters, int tid) {
+    char acc[sizeof(slow_response) + 1];
+    for (long i = 0; i < iters; i++) {
+        size_t offset = 0;
+        while (offset < slow_response_len) {
+            size_t n = slow_response_len - offset < RELAY_CHUNK ? slow_response_len - offset : RELAY_CHUNK;
+            size_t scan_from = offset >= 3 ? offset - 3 : 0;
+            memcpy(acc + offset, slow_response + offset, n);
+            offset += n;
+            if (scan_header_end(acc, offset, scan_from) >= 0) break;
+        }
+        sink += offset;
+    }
+}
+
+// Response size of simulated connection i, 4..64 KB
+static size_t conn_response_size(int i) {
+    return 4096 + ((unsigned)i * 2654435761u) % (60 * 1024);
+}
+
+// CONN_COUNT live connections the way handle_client used to allocate them:
+// malloc'd request and key buffers, and a response grown by realloc doubling
+static void conn_states_malloc(void) {
+    static char piece[CONN_RECV];
+    char **bufs = malloc(CONN_COUNT * 3 * sizeof(char *));
+    for (int i = 0; i < CONN_COUNT; i++) {
+        char *request = malloc(REQUEST_BUFFER_SIZE);
+        char *key = malloc(16384);
+        memset(request, 'r', 1024);
+        memset(key, 'k', 128);
+
+        size_t capacity = 16384, offset = 0, total = conn_response_size(i);
+        char *response = malloc(capacity);
+        while (offset < total) {
+            size_t n = total - offset < CONN_RECV ? total - offset : CONN_RECV;
+            while (offset + n >= capacity) {
+                capacity *= 2;
+                response = realloc(response, capacity);
+            }
+            memcpy(response + offset, piece, n);
+            offset += n;
+        }
+        bufs[i * 3] = request;
+        bufs[i * 3 + 1] = key;
+        bufs[i * 3 + 2] = response;
+    }
+    for (int i = 0; i < CONN_COUNT * 3; i++) free(bufs[i]);
+    free(bufs);
+}
+
+// The same connections on pool buffers and a segment chain
+static void conn_states_pool(void) {
+    static char piece[CONN_RECV];
+    char **bufs = malloc(CONN_COUNT * 2 * sizeof(char *));
+    BufChain *chains = malloc(CONN_COUNT * sizeof(BufChain));
+    for (int i = 0; i < CONN_COUNT; i++) {
+        char *request = pool_alloc(REQUEST_BUFFER_SIZE);
+        char *key = pool_alloc(16384);
+        memset(request, 'r', 1024);
+        memset(key, 'k', 128);
+
+        size_t offset = 0, total = conn_response_size(i);
+        chain_init(&chains[i]);
+        while (offset < total) {
+            size_t n = total - offset < CONN_RECV ? total - offset : CONN_RECV;
+            chain_append(&chains[i], piece, n);
+            offset += n;
+        }
+        bufs[i * 2] = request;
+        bufs[i * 2 + 1] = key;
+    }
+    for (int i = 0; i < CONN_COUNT * 2; i++) pool_free(bufs[i]);
+    for (int i = 0; i < CONN_COUNT; i++) chain_free(&chains[i]);
+    free(bufs);
+    free(chains);
+}
+
+// Run fn in a child process so its peak RSS, and the slab memory the pool
+// carved for it, are measured on their own
+static void run_conn_case(FILE *out, const char *name, void (*fn)(void)) {
+    int fds[2];
+    if (pipe(fds) < 0) return;
+    fflush(out);
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        size_t slab_base = pool_slab_bytes();
+        double start = now_ns();
+        fn();
+        double result[2] = { now_ns() - start, (double)(pool_slab_bytes() - slab_base) };
+        if (write(fds[1], result, sizeof(result)) < 0) _exit(1);
+        _exit(0);
+    }
+    close(fds[1]);
+    double result[2] = { -1, 0 };
+    if (read(fds[0], result, sizeof(result)) != sizeof(result)) result[0] = -1;
+    close(fds[0]);
+
+    int status;
+    struct rusage ru;
+    wait4(pid, &status, 0, &ru);
+    fprintf(out, "%-16s conns=%-6d ms=%9.2f  peak_rss_mb=%8.1f  slab_mb=%8.1f\n",
+            name, CONN_COUNT, result[0] / 1e6, ru.ru_maxrss / 1024.0, result[1] / (1024.0 * 1024.0));
+    fflush(out);
+}
+
+static void *worker_main(void *arg) {
+    Worker *w = arg;
+    pthread_barrier_wait(w->barrier);
+    thread_allocs = 0;
+    unsigned long pool_base = pool_thread_allocs();
+    w->fn(w->iters, w->tid);
+    w->allocs = thread_allocs + pool_thread_allocs() - pool_base;
+    pthread_barrier_wait(w->barrier);
+    return NULL;
+}
+
+// Runs fn on nthreads threads once; returns wall time in ns and total allocations
+static double run_once(bench_fn fn, int nthreads, long iters, unsigned long *allocs) {
+    pthread_t threads[nthreads];
+    Worker workers[nthreads];
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, nthreads + 1);
+
+    for (int i = 0; i < nthreads; i++) {
+        workers[i] = (Worker){ fn, iters, i, &barrier, 0 };
+        pthread_create(&threads[i], NULL, worker_main, &workers[i]);
+    }
+    pthread_barrier_wait(&barrier);
+    double start = now_ns();
+    pthread_barrier_wait(&barrier);
+    double elapsed = now_ns() - start;
+
+    *allocs = 0;
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+        *allocs += workers[i].allocs;
+    }
+    pthread_barrier_destroy(&barrier);
+    return elapsed;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void run_case(FILE *out, const char *name, bench_fn fn, long iters, int max_threads, int reset_cache) {
+    for (int nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+        double samples[REPEATS];
+        unsigned long allocs = 0;
+        for (int r = 0; r < REPEATS; r++) {
+            if (reset_cache) {
+                cache_cleanup();
+                cache_init();
+            }
+            samples[r] = run_once(fn, nthreads, iters, &allocs);
+        }
+        qsort(samples, REPEATS, sizeof(double), cmp_double);
+        double median = samples[REPEATS / 2];
+        long total_ops = iters * nthreads;
+        // ns/op is per-thread latency; Mops/s is aggregate throughput across threads
+        fprintf(out, "%-16s threads=%-3d ns/op=%10.1f  allocs/op=%6.2f  Mops/s=%8.3f\n",
+                name, nthreads, median / iters, (double)allocs / total_ops,
+                total_ops / median * 1e3);
+    }
+    fflush(out);
+}
+
+int main(int argc, char *argv[]) {
+    int max_threads = 8;
+    long scale = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:s:")) != -1) {
+        switch (opt) {
+        case 't': max_threads = atoi(optarg); break;
+        case 's': scale = atol(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-t max_threads] [-s scale]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (max_threads < 1 || scale < 1) return 1;
+
+    // Results go to the original stdout; the proxy's debug output goes to /dev/null
+    FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+    int devnull = open("/dev/null", O_WRONLY);
+    if (!out || devnull < 0) return 1;
+    fflush(stdout);
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+
+    for (int i = 0; i < 16; i++) {
+        snprintf(cache_keys[i], sizeof(cache_keys[i]), "cdn.example.com/static/asset-%02d.js", i);
+    }
+    memset(cached_response, 'x', sizeof(cached_response) - 1);
+    for (size_t i = 0; i < NUM_REQUESTS; i++) request_lengths[i] = strlen(requests[i]);
+
+    size_t pos = snprintf(slow_response, sizeof(slow_response), "HTTP/1.1 200 OK\r\n");
+    for (int i = 0; i < SLOW_HEADERS; i++) {
+        pos += snprintf(slow_response + pos, sizeof(slow_response) - pos,
+                        "X-Trace-%03d: %.*s\r\n", i, 48, "0123456789abcdef0123456789abcdef0123456789abcdef");
+    }
+    pos += snprintf(slow_response + pos, sizeof(slow_response) - pos, "\r\n");
+    memset(slow_response + pos, 'x', sizeof(slow_response) - pos - 1);
+    slow_response_len = sizeof(slow_response) - 1;
+
+    cache_init();
+    run_case(out, "cache_hit", bench_cache_hit, 20000 * scale, max_threads, 1);
+    run_case(out, "cache_mixed", bench_cache_mixed, 20000 * scale, max_threads, 1);
+    run_case(out, "build_cache_key", bench_cache_key, 100000 * scale, max_threads, 0);
+    run_case(out, "is_blocked", bench_is_blocked, 1000000 * scale, max_threads, 0);
+    run_case(out, "parse_request", bench_parse_request, 500000 * scale, max_threads, 0);
+
+    run_case(out, "hdr_end_strstr", bench_header_end_strstr, 2000 * scale, 1, 0);
+    static const int impls[] = { SCAN_SCALAR, SCAN_SSE2, SCAN_AVX2 };
+    for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+        if (scan_select(impls[i]) != impls[i]) continue;
+        char name[32];
+        snprintf(name, sizeof(name), "hdr_end_%s", scan_impl_name());
+        run_case(out, name, bench_header_end_scan, 2000 * scale, 1, 0);
+    }
+    cache_cleanup();
+
+    run_conn_case(out, "conn_malloc", conn_states_malloc);
+    run_conn_case(out, "conn_pool", conn_states_pool);
+
+    fclose(out);
+    return 0;
+}
@@ -0,0 +1,200 @@
+// Local origin stub for load testing the proxy without touching the network.
+//
+// Usage: origin [-p port] [-s bytes | -r min:max] [-c] [-l latency_ms]
+//   -p  listen port on 127.0.0.1 (default 9090)
+//   -s  fixed body size in bytes (default 4096)
+//   -r  random body size in [min, max], stable per request path
+//   -c  send the body with Transfer-Encoding: chunked instead of Content-Length
+//   -l  delay in milliseconds before the response is written
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#define BUFFER_SIZE 8192
+#define CHUNK_SIZE 4096
+
+static int listen_port = 9090;
+static size_t min_size = 4096, max_size = 4096;
+static int use_chunked = 0;
+static int latency_ms = 0;
+static char filler[CHUNK_SIZE];
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-p port] [-s bytes | -r min:max] [-c] [-l latency_ms]\n", prog);
+    exit(1);
+}
+
+// FNV-1a over the request path, so a given URL always gets the same size
+static unsigned long hash_path(const char *s, size_t len) {
+    unsigned long h = 14695981039346656037UL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+static int send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n <= 0) return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Read until the end of the headers, then drain a Content-Length body if any
+static int read_request(int fd, char *buf, size_t cap, const char **path, size_t *path_len) {
+    size_t len = 0;
+    char *end = NULL;
+    while (!end) {
+        if (len >= cap - 1) return -1;
+        ssize_t n = recv(fd, buf + len, cap - 1 - len, 0);
+        if (n <= 0) return -1;
+        len += n;
+        buf[len] = '\0';
+        end = strstr(buf, "\r\n\r\n");
+    }
+
+    char *sp = strchr(buf, ' ');
+    if (!sp) return -1;
+    *path = sp + 1;
+    char *sp2 = strchr(*path, ' ');
+    *path_len = sp2 ? (size_t)(sp2 - *path) : 0;
+
+    long content_length = 0;
+    char *cl = strcasestr(buf, "\r\nContent-Length:");
+    if (cl && cl < end) content_length = atol(cl + 17);
+
+    long body_have = (long)(len - (end + 4 - buf));
+    char drain[BUFFER_SIZE];
+    while (body_have < content_length) {
+        ssize_t n = recv(fd, drain, sizeof(drain), 0);
+        if (n <= 0) return -1;
+        body_have += n;
+    }
+    return 0;
+}
+
+static void *handle_conn(void *arg) {
+    int fd = *(int *)arg;
+    free(arg);
+
+    char buf[BUFFER_SIZE];
+    const char *path = "/";
+    size_t path_len = 1;
+    if (read_request(fd, buf, sizeof(buf), &path, &path_len) < 0) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t body_size = min_size;
+    if (max_size > min_size) {
+        body_size = min_size + hash_path(path, path_len) % (max_size - min_size + 1);
+    }
+
+    if (latency_ms > 0) {
+        struct timespec ts = { latency_ms / 1000, (latency_ms % 1000) * 1000000L };
+        nanosleep(&ts, NULL);
+    }
+
+    char header[256];
+    int hlen;
+    if (use_chunked) {
+        hlen = snprintf(header, sizeof(header),
+                        "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+                        "Transfer-Encoding: chunked\r\nConnection: close\r\n\r\n");
+    } else {
+        hlen = snprintf(header, sizeof(header),
+                        "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+                        "Content-Length: %zu\r\nConnection: close\r\n\r\n", body_size);
+    }
+    if (send_all(fd, header, hlen) < 0) goto done;
+
+    size_t left = body_size;
+    while (left > 0) {
+        size_t n = left < CHUNK_SIZE ? left : CHUNK_SIZE;
+        if (use_chunked) {
+            char size_line[32];
+            int slen = snprintf(size_line, sizeof(size_line), "%zx\r\n", n);
+            if (send_all(fd, size_line, slen) < 0) goto done;
+        }
+        if (send_all(fd, filler, n) < 0) goto done;
+        if (use_chunked && send_all(fd, "\r\n", 2) < 0) goto done;
+        left -= n;
+    }
+    if (use_chunked) send_all(fd, "0\r\n\r\n", 5);
+
+done:
+    close(fd);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "p:s:r:cl:")) != -1) {
+        switch (opt) {
+        case 'p': listen_port = atoi(optarg); break;
+        case 's': min_size = max_size = strtoul(optarg, NULL, 10); break;
+        case 'r':
+            if (sscanf(optarg, "%zu:%zu", &min_size, &max_size) != 2 || max_size < min_size) usage(argv[0]);
+            break;
+        case 'c': use_chunked = 1; break;
+        case 'l': latency_ms = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+    memset(filler, 'x', sizeof(filler));
+
+    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_fd < 0) {
+        perror("[-] Unable to create socket");
+        return 1;
+    }
+    int one = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(listen_port);
+
+    if (bind(server_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("[-] Bind failed");
+        return 1;
+    }
+    if (listen(server_fd, 1024) < 0) {
+        perror("[-] Listen failed");
+        return 1;
+    }
+    fprintf(stderr, "[+] Origin stub on 127.0.0.1:%d, body %zu..%zu bytes, %s, latency %d ms\n",
+            listen_port, min_size, max_size, use_chunked ? "chunked" : "content-length", latency_ms);
+
+    while (1) {
+        int *client_fd = malloc(sizeof(int));
+        *client_fd = accept(server_fd, NULL, NULL);
+        if (*client_fd < 0) {
+            free(client_fd);
+            continue;
+        }
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, handle_conn, client_fd) != 0) {
+            close(*client_fd);
+            free(client_fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return 0;
+}
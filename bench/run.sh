@@ -0,0 +1,19 @@
+#!/bin/sh
+# Runs one load test against a proxy that is already listening on 127.0.0.1:8080.
+#
+#   ORIGIN_ARGS  options for the origin stub (default: fixed 4 KB bodies)
+#   PROXY_PID    pid of the running proxy, to include its CPU usage in the report
+#
+# Any arguments are passed to loadgen, e.g.: bench/run.sh -c 32 -d 10 -m 70:20:10 -h 0.9
+cd "$(dirname "$0")" || exit 1
+
+./origin ${ORIGIN_ARGS:--s 4096} &
+ORIGIN=$!
+trap 'kill $ORIGIN 2>/dev/null' EXIT INT TERM
+sleep 0.2
+
+if [ -n "$PROXY_PID" ]; then
+    ./loadgen -x "$PROXY_PID" "$@"
+else
+    ./loadgen "$@"
+fi
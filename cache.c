@@ -1,4 +1,6 @@
 #include "cache.h"
+#include "compress.h"
+#include "scan.h"
 #include "gui.h"
 #include <string.h>
 #include <stdlib.h>
@@ -11,27 +13,35 @@ CacheNode *head = NULL, *tail = NULL;
 int cache_count = 0;
 static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-CacheNode* create_node(const char *key, const char *response) {
-    CacheNode *node = (CacheNode *)malloc(sizeof(CacheNode));
+// Prefetched entries that were served, and ones dropped before anyone asked
+static unsigned long prefetch_hits = 0;
+static unsigned long prefetch_wasted = 0;
+static unsigned long long prefetch_wasted_bytes = 0;
+
+// One pool block holds the node, its key and its response
+static CacheNode* alloc_node(const char *key, size_t response_len) {
+    size_t key_len = strlen(key);
+    CacheNode *node = pool_alloc(sizeof(CacheNode) + key_len + 1 + response_len + 1);
     if (!node) return NULL;
     
-    node->key = strdup(key);
-    if (!node->key) {
-        free(node);
-        return NULL;
-    }
-    
-    node->response = strdup(response);
-    if (!node->response) {
-        free(node->key);
-        free(node);
-        return NULL;
-    }
-    
+    node->key = (char *)(node + 1);
+    memcpy(node->key, key, key_len + 1);
+    node->response = node->key + key_len + 1;
+    node->response[response_len] = '\0';
+    node->response_len = response_len;
+    node->flags = 0;
     node->prev = node->next = NULL;
     return node;
 }
 
+CacheNode* create_node(const char *key, const char *response) {
+    size_t len = strlen(response);
+    CacheNode *node = alloc_node(key, len);
+    if (!node) return NULL;
+    memcpy(node->response, response, len);
+    return node;
+}
+
 void move_to_head(CacheNode *node) {
     if (!node || node == head) return;
     
@@ -50,72 +60,154 @@ void move_to_head(CacheNode *node) {
     if (!tail) tail = head;
 }
 
-void add_to_cache(const char *key, const char *response) {
-    if (!key || !response) return;
-    
+static void unlink_node(CacheNode *node) {
+    if (node->prev) node->prev->next = node->next;
+    else head = node->next;
+    if (node->next) node->next->prev = node->prev;
+    else tail = node->prev;
+    node->prev = node->next = NULL;
+}
+
+// Free a node leaving the cache; called with cache_mutex held
+static void drop_node(CacheNode *node) {
+    if (node->flags & CACHE_PREFETCHED) {
+        prefetch_wasted++;
+        prefetch_wasted_bytes += node->response_len;
+    }
+    pool_free(node);
+}
+
+// Oldest prefetched entry nobody has asked for yet; called with cache_mutex held
+static CacheNode* oldest_prefetched(void) {
+    CacheNode *node = tail;
+    while (node && !(node->flags & CACHE_PREFETCHED)) node = node->prev;
+    return node;
+}
+
+// Insert a filled node, replacing an entry with the same key. Prefetched
+// nodes go in at the LRU end and only ever displace other unserved
+// prefetched entries, so prefetch cannot push out what clients use.
+// Returns -1 when the node was not stored (and has been freed).
+static int insert_node(CacheNode *node) {
+    int prefetched = node->flags & CACHE_PREFETCHED;
     pthread_mutex_lock(&cache_mutex);
     
-    printf("[CACHE DEBUG] Adding to cache - Key: %s\n", key);
+    printf("[CACHE DEBUG] Adding to cache - Key: %s\n", node->key);
     
     // Check if key already exists
-    CacheNode *existing = NULL;
     CacheNode *current = head;
     while (current) {
-        if (strcmp(current->key, key) == 0) {
-            existing = current;
+        if (strcmp(current->key, node->key) == 0) {
             printf("[CACHE DEBUG] Found existing key in cache\n");
+            if (prefetched) {
+                // A client fetched it meanwhile; keep that entry where it is
+                pthread_mutex_unlock(&cache_mutex);
+                pool_free(node);
+                return -1;
+            }
+            unlink_node(current);
+            drop_node(current);
+            cache_count--;
+            printf("[CACHE DEBUG] Updated existing cache entry\n");
             break;
         }
         current = current->next;
     }
     
-    if (existing) {
-        // Update existing node
-        char *new_response = strdup(response);
-        if (new_response) {
-            free(existing->response);
-            existing->response = new_response;
-            move_to_head(existing);
-            printf("[CACHE DEBUG] Updated existing cache entry\n");
-        }
-        pthread_mutex_unlock(&cache_mutex);
-        return;
-    }
-    
-    // Create new node
-    CacheNode *node = create_node(key, response);
-    if (!node) {
-        printf("[CACHE DEBUG] Failed to create cache node\n");
-        pthread_mutex_unlock(&cache_mutex);
-        return;
-    }
-    
     // Remove oldest entry if cache is full
     if (cache_count == CACHE_SIZE && tail) {
-        CacheNode *to_remove = tail;
-        tail = tail->prev;
-        if (tail) tail->next = NULL;
-        else head = NULL;
-        
+        CacheNode *to_remove = prefetched ? oldest_prefetched() : tail;
+        if (!to_remove) {
+            printf("[CACHE DEBUG] No room for prefetched entry: %s\n", node->key);
+            pthread_mutex_unlock(&cache_mutex);
+            pool_free(node);
+            return -1;
+        }
+        unlink_node(to_remove);
         printf("[CACHE DEBUG] Removing oldest entry: %s\n", to_remove->key);
-        free(to_remove->key);
-        free(to_remove->response);
-        free(to_remove);
+        drop_node(to_remove);
         cache_count--;
     }
     
-    // Add new node to head
-    node->next = head;
-    if (head) head->prev = node;
-    head = node;
-    if (!tail) tail = head;
+    if (prefetched) {
+        // Add new node to tail
+        node->prev = tail;
+        if (tail) tail->next = node;
+        tail = node;
+        if (!head) head = tail;
+    } else {
+        // Add new node to head
+        node->next = head;
+        if (head) head->prev = node;
+        head = node;
+        if (!tail) tail = head;
+    }
     cache_count++;
     printf("[CACHE DEBUG] Added new entry to cache. Total entries: %d\n", cache_count);
     
     pthread_mutex_unlock(&cache_mutex);
+    return 0;
+}
+
+void add_to_cache(const char *key, const char *response) {
+    if (!key || !response) return;
+    
+    // Build the node outside the lock
+    CacheNode *node = create_node(key, response);
+    if (!node) {
+        printf("[CACHE DEBUG] Failed to create cache node\n");
+        return;
+    }
+    insert_node(node);
+}
+
+// Cache a response accumulated in buffer segments, copying it exactly once.
+// Returns -1 if it was not stored.
+int add_to_cache_chain(const char *key, const BufChain *response, int flags) {
+    if (!key || !response) return -1;
+    
+    CacheNode *node = alloc_node(key, response->total);
+    if (!node) {
+        printf("[CACHE DEBUG] Failed to create cache node\n");
+        return -1;
+    }
+    chain_copy(response, node->response);
+    node->flags = flags;
+    return insert_node(node);
+}
+
+// Whether a response with this status line is cacheable; data holds at
+// least the start of the response
+int cache_status_ok(const char *data, size_t len) {
+    return len >= 12 && (memcmp(data, "HTTP/1.1 200", 12) == 0 || memcmp(data, "HTTP/1.0 200", 12) == 0);
+}
+
+// Store a complete response collected in segments, gzipped when it is text
+// the origin left uncompressed. Only a 200 whose headers fit in the first
+// segment is stored. Returns 0 when stored, CACHE_NOT_CACHEABLE, or
+// CACHE_NOT_STORED when the cache would not take it.
+int cache_store_response(const char *key, const BufChain *response, int extra_flags) {
+    const Segment *first = response->head;
+    if (!first || scan_header_end(first->data, first->len, 0) < 0 || !cache_status_ok(first->data, first->len)) {
+        return CACHE_NOT_CACHEABLE;
+    }
+
+    BufChain packed;
+    chain_init(&packed);
+    int rc;
+    if (compress_response(response, &packed) == 0) {
+        printf("[CACHE DEBUG] Caching gzipped response of size: %zu bytes\n", packed.total);
+        rc = add_to_cache_chain(key, &packed, CACHE_GZIP | extra_flags);
+        chain_free(&packed);
+    } else {
+        printf("[CACHE DEBUG] Caching response of size: %zu bytes\n", response->total);
+        rc = add_to_cache_chain(key, response, extra_flags);
+    }
+    return rc < 0 ? CACHE_NOT_STORED : 0;
 }
 
-char* find_in_cache(const char *key) {
+// Returns a copy of the cached response (release with pool_free) and its length
+char* find_in_cache(const char *key, size_t *len, int *flags) {
     if (!key) return NULL;
     
     pthread_mutex_lock(&cache_mutex);
@@ -126,7 +218,17 @@ char* find_in_cache(const char *key) {
         printf("[CACHE DEBUG] Comparing with cached key: %s\n", node->key);
         if (strcmp(node->key, key) == 0) {
             move_to_head(node);
-            char *resp = strdup(node->response);
+            char *resp = pool_alloc(node->response_len + 1);
+            if (resp) {
+                memcpy(resp, node->response, node->response_len + 1);
+                if (len) *len = node->response_len;
+                if (flags) *flags = node->flags;
+            }
+            if (node->flags & CACHE_PREFETCHED) {
+                // The first hit is what the prefetch was for
+                node->flags &= ~CACHE_PREFETCHED;
+                prefetch_hits++;
+            }
             printf("[CACHE DEBUG] Cache HIT!\n");
             pthread_mutex_unlock(&cache_mutex);
             return resp;
@@ -138,6 +240,22 @@ char* find_in_cache(const char *key) {
     return NULL;
 }
 
+// Drop an entry that turned out to be unusable
+void remove_from_cache(const char *key) {
+    if (!key) return;
+
+    pthread_mutex_lock(&cache_mutex);
+    CacheNode *node = head;
+    while (node && strcmp(node->key, key) != 0) node = node->next;
+    if (node) {
+        printf("[CACHE DEBUG] Removing entry: %s\n", key);
+        unlink_node(node);
+        drop_node(node);
+        cache_count--;
+    }
+    pthread_mutex_unlock(&cache_mutex);
+}
+
 void cache_init() {
     pthread_mutex_lock(&cache_mutex);
     head = tail = NULL;
@@ -150,9 +268,7 @@ void cache_cleanup() {
     CacheNode *node = head;
     while (node) {
         CacheNode *next = node->next;
-        free(node->key);
-        free(node->response);
-        free(node);
+        pool_free(node);
         node = next;
     }
     head = tail = NULL;
@@ -166,4 +282,20 @@ void log_cache_event(const char *key, int hit) {
     snprintf(message, sizeof(message), "%s: Cache %s", key, hit ? "Hit" : "Miss");
     char *msg = strdup(message);
     if (msg) g_idle_add(log_message_idle, msg);
-}
\ No newline at end of file
+}
+
+int cache_contains(const char *key) {
+    pthread_mutex_lock(&cache_mutex);
+    CacheNode *node = head;
+    while (node && strcmp(node->key, key) != 0) node = node->next;
+    pthread_mutex_unlock(&cache_mutex);
+    return node != NULL;
+}
+
+void cache_prefetch_stats(unsigned long *hits, unsigned long *wasted, unsigned long long *wasted_bytes) {
+    pthread_mutex_lock(&cache_mutex);
+    *hits = prefetch_hits;
+    *wasted = prefetch_wasted;
+    *wasted_bytes = prefetch_wasted_bytes;
+    pthread_mutex_unlock(&cache_mutex);
+}
@@ -2,10 +2,21 @@
 #define CACHE_H
 
 #include <stddef.h>
+#include "pool.h"
+
+// Entry flags
+#define CACHE_GZIP 0x1      // response was gzipped by the proxy before storing
+#define CACHE_PREFETCHED 0x2    // fetched ahead of any request and not served yet
+
+// cache_store_response results besides 0
+#define CACHE_NOT_CACHEABLE -1  // not a 200 with its headers in the first segment
+#define CACHE_NOT_STORED -2     // the cache had no room for it
 
 typedef struct CacheNode {
     char *key;
     char *response;
+    size_t response_len;
+    int flags;
     struct CacheNode *prev, *next;
 } CacheNode;
 
@@ -19,6 +30,12 @@ void cache_cleanup();
 CacheNode* create_node(const char *key, const char *response);
 void move_to_head(CacheNode *node);
 void add_to_cache(const char *key, const char *response);
-char* find_in_cache(const char *key);
+int add_to_cache_chain(const char *key, const BufChain *response, int flags);
+int cache_status_ok(const char *data, size_t len);
+int cache_store_response(const char *key, const BufChain *response, int extra_flags);
+char* find_in_cache(const char *key, size_t *len, int *flags);
+void remove_from_cache(const char *key);
+int cache_contains(const char *key);
+void cache_prefetch_stats(unsigned long *hits, unsigned long *wasted, unsigned long long *wasted_bytes);
 
 #endif
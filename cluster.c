@@ -0,0 +1,260 @@
+#include "cluster.h"
+#include "config.h"
+#include "gui.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define MAX_PEERS 32
+#define MAX_VNODES 256
+#define HEALTH_CONNECT_TIMEOUT_MS 500
+
+typedef struct {
+    char host[256];
+    int port;
+    int is_self;
+    int healthy;
+} Peer;
+
+typedef struct {
+    uint64_t hash;
+    int peer;
+} RingPoint;
+
+static Peer peers[MAX_PEERS];
+static int num_peers = 0;
+static int vnodes = 64;
+static long health_interval_ms = 1000;
+
+// Rebuilt whenever membership changes; lookups take the read lock
+static RingPoint ring[MAX_PEERS * MAX_VNODES];
+static int ring_size = 0;
+static pthread_rwlock_t ring_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// FNV-1a with a final avalanche step: labels and keys that differ only in
+// their last bytes would otherwise land next to each other on the ring
+static uint64_t ring_hash(const char *data, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)data[i];
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static int compare_points(const void *a, const void *b) {
+    const RingPoint *x = a, *y = b;
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    return x->peer - y->peer;
+}
+
+// Place vnodes points per healthy member; called with ring_lock held for writing.
+// Points are derived from host:port only, so every member builds the same ring.
+static void rebuild_ring(void) {
+    ring_size = 0;
+    for (int p = 0; p < num_peers; p++) {
+        if (!peers[p].healthy) continue;
+        for (int v = 0; v < vnodes; v++) {
+            char label[300];
+            int len = snprintf(label, sizeof(label), "%s:%d#%d", peers[p].host, peers[p].port, v);
+            ring[ring_size].hash = ring_hash(label, len);
+            ring[ring_size].peer = p;
+            ring_size++;
+        }
+    }
+    qsort(ring, ring_size, sizeof(RingPoint), compare_points);
+}
+
+static void log_peer_state(const Peer *peer, int healthy) {
+    char message[320];
+    snprintf(message, sizeof(message), "[CLUSTER] Peer %s:%d is %s",
+             peer->host, peer->port, healthy ? "up" : "down");
+    printf("%s\n", message);
+    char *msg = strdup(message);
+    if (msg) g_idle_add(log_message_idle, msg);
+}
+
+// Mark a peer up or down and rebalance the ring when that changes anything
+static void set_peer_health(int p, int healthy) {
+    pthread_rwlock_wrlock(&ring_lock);
+    int changed = peers[p].healthy != healthy;
+    if (changed) {
+        peers[p].healthy = healthy;
+        rebuild_ring();
+    }
+    pthread_rwlock_unlock(&ring_lock);
+    if (changed) log_peer_state(&peers[p], healthy);
+}
+
+// A TCP connect that gives up after timeout_ms
+static int probe_peer(const Peer *peer, int timeout_ms) {
+    struct addrinfo hints, *res;
+    char port[16];
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%d", peer->port);
+    if (getaddrinfo(peer->host, port, &hints, &res) != 0) return 0;
+
+    int ok = 0;
+    int fd = socket(res->ai_family, SOCK_STREAM, 0);
+    if (fd >= 0) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        int rc = connect(fd, res->ai_addr, res->ai_addrlen);
+        if (rc == 0) {
+            ok = 1;
+        } else if (errno == EINPROGRESS) {
+            struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+            int err = 0;
+            socklen_t errlen = sizeof(err);
+            if (poll(&pfd, 1, timeout_ms) == 1 &&
+                getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == 0 && err == 0) {
+                ok = 1;
+            }
+        }
+        close(fd);
+    }
+    freeaddrinfo(res);
+    return ok;
+}
+
+static void* health_thread_func(void *arg) {
+    while (1) {
+        usleep(health_interval_ms * 1000);
+        for (int p = 0; p < num_peers; p++) {
+            if (peers[p].is_self) continue;
+            set_peer_health(p, probe_peer(&peers[p], HEALTH_CONNECT_TIMEOUT_MS));
+        }
+    }
+    return NULL;
+}
+
+static int parse_peer(const char *entry, size_t len, char *host, size_t hostsize, int *port) {
+    const char *colon = memchr(entry, ':', len);
+    if (!colon || (size_t)(colon - entry) >= hostsize) return -1;
+    memcpy(host, entry, colon - entry);
+    host[colon - entry] = '\0';
+    *port = atoi(colon + 1);
+    return *port > 0 ? 0 : -1;
+}
+
+static void add_peer(const char *host, int port, int is_self) {
+    for (int p = 0; p < num_peers; p++) {
+        if (peers[p].port == port && strcmp(peers[p].host, host) == 0) {
+            peers[p].is_self |= is_self;
+            return;
+        }
+    }
+    if (num_peers == MAX_PEERS) {
+        fprintf(stderr, "[-] Too many peers, ignoring %s:%d\n", host, port);
+        return;
+    }
+    Peer *peer = &peers[num_peers++];
+    strncpy(peer->host, host, sizeof(peer->host) - 1);
+    peer->port = port;
+    peer->is_self = is_self;
+    // Peers start up and are taken out by the first failed probe
+    peer->healthy = 1;
+}
+
+void cluster_init(int listen_port) {
+    const char *list = config_string("PROXY_PEERS", NULL);
+    if (!list) return;
+
+    vnodes = config_long("PROXY_VNODES", 64);
+    if (vnodes > MAX_VNODES) vnodes = MAX_VNODES;
+    health_interval_ms = config_long("PROXY_HEALTH_INTERVAL_MS", 1000);
+
+    char self_host[256] = "127.0.0.1";
+    int self_port = listen_port;
+    const char *self = config_string("PROXY_SELF", NULL);
+    if (self && parse_peer(self, strlen(self), self_host, sizeof(self_host), &self_port) < 0) {
+        fprintf(stderr, "[-] Ignoring invalid PROXY_SELF=%s\n", self);
+    }
+
+    const char *p = list;
+    while (*p) {
+        size_t len = strcspn(p, ",");
+        char host[256];
+        int port;
+        if (len > 0 && parse_peer(p, len, host, sizeof(host), &port) == 0) {
+            add_peer(host, port, port == self_port && strcmp(host, self_host) == 0);
+        } else if (len > 0) {
+            fprintf(stderr, "[-] Ignoring invalid peer %.*s\n", (int)len, p);
+        }
+        p += len;
+        if (*p == ',') p++;
+    }
+    // This instance is always a member, even if the list leaves it out
+    add_peer(self_host, self_port, 1);
+
+    pthread_rwlock_wrlock(&ring_lock);
+    rebuild_ring();
+    pthread_rwlock_unlock(&ring_lock);
+
+    printf("[CLUSTER] %d members, %d virtual nodes each, self %s:%d\n",
+           num_peers, vnodes, self_host, self_port);
+
+    if (num_peers > 1) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, health_thread_func, NULL) == 0) {
+            pthread_detach(thread);
+        }
+    }
+}
+
+int cluster_enabled(void) {
+    return num_peers > 1;
+}
+
+// Returns 1 and fills host/port when another member owns key, 0 when this
+// instance should serve it itself
+int cluster_owner(const char *key, char *host, size_t hostsize, int *port) {
+    if (num_peers <= 1) return 0;
+
+    uint64_t h = ring_hash(key, strlen(key));
+    int owner = -1;
+
+    pthread_rwlock_rdlock(&ring_lock);
+    if (ring_size > 0) {
+        // First point clockwise from the key's hash, wrapping at the end
+        int lo = 0, hi = ring_size;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (ring[mid].hash < h) lo = mid + 1;
+            else hi = mid;
+        }
+        owner = ring[lo == ring_size ? 0 : lo].peer;
+    }
+    int remote = owner >= 0 && !peers[owner].is_self;
+    if (remote) {
+        snprintf(host, hostsize, "%s", peers[owner].host);
+        *port = peers[owner].port;
+    }
+    pthread_rwlock_unlock(&ring_lock);
+    return remote;
+}
+
+// A request to the peer failed; take it out until the health check sees it again
+void cluster_peer_failed(const char *host, int port) {
+    for (int p = 0; p < num_peers; p++) {
+        if (!peers[p].is_self && peers[p].port == port && strcmp(peers[p].host, host) == 0) {
+            set_peer_health(p, 0);
+            return;
+        }
+    }
+}
@@ -0,0 +1,29 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <stddef.h>
+
+// Cooperative caching across proxy instances. Every member lists the same
+// peers, and a consistent hash ring with virtual nodes maps each cache key
+// to the member that owns it. A miss owned by another member is fetched
+// through that member, so each object comes from the origin once and is
+// stored once. Requests between members carry X-Proxy-Peer so they are
+// never forwarded a second time.
+//
+//   PROXY_PEERS                all members as host:port,host:port,...
+//   PROXY_SELF                 this member's entry (default 127.0.0.1:<port>)
+//   PROXY_VNODES               virtual nodes per member (default 64)
+//   PROXY_HEALTH_INTERVAL_MS   peer health check period (default 1000)
+//
+// Three members on one machine:
+//   PROXY_PORT=8081 PROXY_PEERS=127.0.0.1:8081,127.0.0.1:8082,127.0.0.1:8083 ./proxy
+//   PROXY_PORT=8082 PROXY_PEERS=127.0.0.1:8081,127.0.0.1:8082,127.0.0.1:8083 ./proxy
+//   PROXY_PORT=8083 PROXY_PEERS=127.0.0.1:8081,127.0.0.1:8082,127.0.0.1:8083 ./proxy
+#define PEER_HEADER "X-Proxy-Peer"
+
+void cluster_init(int listen_port);
+int cluster_enabled(void);
+int cluster_owner(const char *key, char *host, size_t hostsize, int *port);
+void cluster_peer_failed(const char *host, int port);
+
+#endif
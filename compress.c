@@ -0,0 +1,417 @@
+#include "compress.h"
+#include "config.h"
+#include "scan.h"
+#include "gui.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#define REPORT_EVERY 32
+
+enum {
+    TYPE_HTML,
+    TYPE_JSON,
+    TYPE_JAVASCRIPT,
+    TYPE_CSS,
+    TYPE_XML,
+    TYPE_TEXT,
+    NUM_TYPES
+};
+
+static const char *type_names[NUM_TYPES] = {
+    "html", "json", "javascript", "css", "xml", "text"
+};
+
+typedef struct {
+    unsigned long compressed;
+    unsigned long not_smaller;      // stored as they were
+    unsigned long long bytes_in, bytes_out;
+    unsigned long long compress_ns;
+    unsigned long decoded;          // hits decoded for clients without gzip
+    unsigned long long decode_ns;
+} TypeStats;
+
+static int enabled = 1;
+static int level = 6;
+static long min_bytes = 256;
+
+static TypeStats stats[NUM_TYPES];
+static unsigned long total_compressed = 0;
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void compress_init(void) {
+    const char *mode = config_string("PROXY_COMPRESS", "on");
+    enabled = strcmp(mode, "off") != 0 && strcmp(mode, "0") != 0;
+    level = config_long("PROXY_COMPRESS_LEVEL", 6);
+    if (level > 9) level = 9;
+    min_bytes = config_long("PROXY_COMPRESS_MIN_BYTES", 256);
+    printf("[COMPRESS] %s, level %d, bodies of %ld bytes and up\n",
+           enabled ? "enabled" : "disabled", level, min_bytes);
+}
+
+static unsigned long long thread_cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Length of the line at p (including its LF) within end
+static size_t line_length(const char *p, const char *end) {
+    const char *lf = memchr(p, '\n', end - p);
+    return lf ? (size_t)(lf - p + 1) : (size_t)(end - p);
+}
+
+static int line_is(const char *line, size_t len, const char *name) {
+    size_t n = strlen(name);
+    return len > n && line[n] == ':' && strncasecmp(line, name, n) == 0;
+}
+
+// Value of a response header, trimmed, or NULL; head spans the header block
+static const char* header_value(const char *head, size_t head_len, const char *name, size_t *vlen) {
+    const char *end = head + head_len;
+    const char *p = head + line_length(head, end);     // skip the status line
+    while (p < end) {
+        size_t len = line_length(p, end);
+        if (line_is(p, len, name)) {
+            const char *v = p + strlen(name) + 1;
+            const char *e = p + len;
+            while (v < e && (*v == ' ' || *v == '\t')) v++;
+            while (e > v && (e[-1] == '\r' || e[-1] == '\n' || e[-1] == ' ')) e--;
+            *vlen = e - v;
+            return v;
+        }
+        p += len;
+    }
+    return NULL;
+}
+
+static int has_token(const char *v, size_t len, const char *token) {
+    size_t n = strlen(token);
+    for (size_t i = 0; i + n <= len; i++) {
+        if (strncasecmp(v + i, token, n) == 0) return 1;
+    }
+    return 0;
+}
+
+// Which text type a Content-Type names, or -1 for anything not worth compressing
+static int classify(const char *head, size_t head_len) {
+    size_t len;
+    const char *v = header_value(head, head_len, "content-type", &len);
+    if (!v) return -1;
+    if (has_token(v, len, "text/html")) return TYPE_HTML;
+    if (has_token(v, len, "json")) return TYPE_JSON;
+    if (has_token(v, len, "javascript") || has_token(v, len, "ecmascript")) return TYPE_JAVASCRIPT;
+    if (has_token(v, len, "text/css")) return TYPE_CSS;
+    if (has_token(v, len, "xml")) return TYPE_XML;
+    if (len >= 5 && strncasecmp(v, "text/", 5) == 0) return TYPE_TEXT;
+    return -1;
+}
+
+// Copy the status line and every header except the framing ones we rewrite;
+// dst needs head_len bytes. The blank line is left for the caller to add.
+static size_t copy_kept_headers(const char *head, size_t head_len, char *dst) {
+    const char *end = head + head_len;
+    const char *p = head;
+    size_t n = 0;
+    while (p < end) {
+        size_t len = line_length(p, end);
+        if (len <= 2 && (*p == '\r' || *p == '\n')) break;
+        if (!line_is(p, len, "content-length") && !line_is(p, len, "content-encoding")) {
+            memcpy(dst + n, p, len);
+            n += len;
+        }
+        p += len;
+    }
+    return n;
+}
+
+static void report(int type, size_t in, size_t out, unsigned long long ns) {
+    char summary[NUM_TYPES][256];
+    int lines = 0;
+
+    pthread_mutex_lock(&stats_mutex);
+    total_compressed++;
+    if (total_compressed % REPORT_EVERY == 0) {
+        for (int t = 0; t < NUM_TYPES; t++) {
+            TypeStats *s = &stats[t];
+            if (s->compressed == 0 && s->not_smaller == 0) continue;
+            snprintf(summary[lines++], sizeof(summary[0]),
+                     "[COMPRESS] %s: %lu stored gzip, %lu as is, %llu -> %llu bytes (%.1f%%), "
+                     "%.2f ms CPU; %lu hits decoded (%.2f ms CPU)",
+                     type_names[t], s->compressed, s->not_smaller, s->bytes_in, s->bytes_out,
+                     s->bytes_in ? 100.0 * s->bytes_out / s->bytes_in : 0.0, s->compress_ns / 1e6,
+                     s->decoded, s->decode_ns / 1e6);
+        }
+    }
+    pthread_mutex_unlock(&stats_mutex);
+
+    printf("[COMPRESS] %s: %zu -> %zu bytes (%.1f%%) in %.3f ms CPU\n",
+           type_names[type], in, out, in ? 100.0 * out / in : 0.0, ns / 1e6);
+    for (int i = 0; i < lines; i++) {
+        printf("%s\n", summary[i]);
+        char *msg = strdup(summary[i]);
+        if (msg) g_idle_add(log_message_idle, msg);
+    }
+}
+
+// Gzip the body of a complete 200 response held in in, writing the response
+// with rewritten headers to out. Returns -1 (out untouched) when the response
+// is not eligible or would not shrink.
+int compress_response(const BufChain *in, BufChain *out) {
+    if (!enabled || !in->head) return -1;
+
+    // The relay keeps the whole header block in the first segment
+    const Segment *first = in->head;
+    long blank = scan_header_end(first->data, first->len, 0);
+    if (blank < 0) return -1;
+    size_t hdr_end = blank + 4;
+    const char *head = first->data;
+    size_t body_len = in->total - hdr_end;
+    if (in->total < hdr_end || (long)body_len < min_bytes) return -1;
+
+    size_t len;
+    if (header_value(head, hdr_end, "content-encoding", &len) ||
+        header_value(head, hdr_end, "transfer-encoding", &len)) {
+        return -1;
+    }
+    const char *cl = header_value(head, hdr_end, "content-length", &len);
+    if (cl && strtoull(cl, NULL, 10) != body_len) return -1;
+    int type = classify(head, hdr_end);
+    if (type < 0) return -1;
+
+    unsigned long long start = thread_cpu_ns();
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return -1;
+
+    BufChain body;
+    chain_init(&body);
+    size_t off = hdr_end;
+    for (const Segment *s = first; s; s = s->next, off = 0) {
+        int flush = s->next ? Z_NO_FLUSH : Z_FINISH;
+        zs.next_in = (Bytef *)s->data + off;
+        zs.avail_in = s->len - off;
+        int rc;
+        do {
+            size_t avail;
+            char *dst = chain_reserve(&body, &avail);
+            if (!dst) {
+                deflateEnd(&zs);
+                chain_free(&body);
+                return -1;
+            }
+            zs.next_out = (Bytef *)dst;
+            zs.avail_out = avail;
+            rc = deflate(&zs, flush);
+            chain_commit(&body, avail - zs.avail_out);
+        } while (rc != Z_STREAM_ERROR && (zs.avail_out == 0 || (flush == Z_FINISH && rc != Z_STREAM_END)));
+    }
+    deflateEnd(&zs);
+    unsigned long long ns = thread_cpu_ns() - start;
+
+    if (body.total >= body_len) {
+        chain_free(&body);
+        pthread_mutex_lock(&stats_mutex);
+        stats[type].not_smaller++;
+        pthread_mutex_unlock(&stats_mutex);
+        return -1;
+    }
+
+    size_t packed_len = body.total;
+    char *kept = pool_alloc(hdr_end);
+    char added[128];
+    int added_len = snprintf(added, sizeof(added),
+                             "Content-Encoding: gzip\r\nContent-Length: %zu\r\nVary: Accept-Encoding\r\n\r\n",
+                             packed_len);
+    int rc = kept ? 0 : -1;
+    if (rc == 0) rc = chain_append(out, kept, copy_kept_headers(head, hdr_end, kept));
+    if (rc == 0) rc = chain_append(out, added, added_len);
+    for (const Segment *s = body.head; s && rc == 0; s = s->next) {
+        rc = chain_append(out, s->data, s->len);
+    }
+    pool_free(kept);
+    chain_free(&body);
+    if (rc < 0) {
+        chain_free(out);
+        return -1;
+    }
+
+    pthread_mutex_lock(&stats_mutex);
+    stats[type].compressed++;
+    stats[type].bytes_in += body_len;
+    stats[type].bytes_out += packed_len;
+    stats[type].compress_ns += ns;
+    pthread_mutex_unlock(&stats_mutex);
+
+    report(type, body_len, packed_len, ns);
+    return 0;
+}
+
+// Choose a coding from an Accept-Encoding value, honouring q=0 and "*"
+ContentCoding compress_pick_coding(const char *accept, size_t len) {
+    if (!accept) return CODING_IDENTITY;
+
+    char value[256];
+    if (len >= sizeof(value)) len = sizeof(value) - 1;
+    memcpy(value, accept, len);
+    value[len] = '\0';
+
+    double q_gzip = -1, q_deflate = -1, q_any = -1;
+    char *save;
+    for (char *item = strtok_r(value, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        while (*item == ' ' || *item == '\t') item++;
+        size_t name_len = strcspn(item, " \t;");
+        double q = 1.0;
+        char *params = strchr(item, ';');
+        if (params) {
+            char *qp = strstr(params, "q=");
+            if (qp) q = strtod(qp + 2, NULL);
+        }
+        if ((name_len == 4 && strncasecmp(item, "gzip", 4) == 0) ||
+            (name_len == 6 && strncasecmp(item, "x-gzip", 6) == 0)) {
+            q_gzip = q;
+        } else if (name_len == 7 && strncasecmp(item, "deflate", 7) == 0) {
+            q_deflate = q;
+        } else if (name_len == 1 && *item == '*') {
+            q_any = q;
+        }
+    }
+    if (q_gzip < 0) q_gzip = q_any;
+    if (q_deflate < 0) q_deflate = q_any;
+
+    if (q_gzip > 0 && q_gzip >= q_deflate) return CODING_GZIP;
+    if (q_deflate > 0) return CODING_DEFLATE;
+    return CODING_IDENTITY;
+}
+
+// Length of the gzip member header at gz (RFC 1952), or 0 if it is malformed
+static size_t gzip_header_length(const unsigned char *gz, size_t len) {
+    if (len < 10 || gz[0] != 0x1f || gz[1] != 0x8b || gz[2] != Z_DEFLATED) return 0;
+    int flags = gz[3];
+    size_t n = 10;
+    if (flags & 0x04) {                         // FEXTRA
+        if (len < n + 2) return 0;
+        n += 2 + (gz[n] | gz[n + 1] << 8);
+    }
+    for (int bit = 0x08; bit <= 0x10; bit <<= 1) {  // FNAME, FCOMMENT
+        if (!(flags & bit)) continue;
+        const unsigned char *nul = n < len ? memchr(gz + n, '\0', len - n) : NULL;
+        if (!nul) return 0;
+        n = nul - gz + 1;
+    }
+    if (flags & 0x02) n += 2;                   // FHCRC
+    return n < len ? n : 0;
+}
+
+// Inflate a gzip member without keeping the output, only its adler32. The
+// gzip wrapper still checks the CRC and length, so a damaged entry fails here.
+static int gzip_adler32(const unsigned char *gz, size_t gz_len, uint32_t isize, uLong *adler) {
+    unsigned char scratch[16384];
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, 15 + 16) != Z_OK) return -1;
+    zs.next_in = (Bytef *)gz;
+    zs.avail_in = gz_len;
+
+    *adler = adler32(0L, Z_NULL, 0);
+    int rc;
+    do {
+        zs.next_out = scratch;
+        zs.avail_out = sizeof(scratch);
+        rc = inflate(&zs, Z_NO_FLUSH);
+        *adler = adler32(*adler, scratch, sizeof(scratch) - zs.avail_out);
+    } while (rc == Z_OK);
+    inflateEnd(&zs);
+    return rc == Z_STREAM_END && zs.avail_in == 0 && zs.total_out == isize ? 0 : -1;
+}
+
+// Turn a stored gzip response into one a client without gzip can take.
+// Returns a pool buffer (release with pool_free) or NULL.
+char* compress_transcode(const char *resp, size_t len, ContentCoding coding, size_t *out_len) {
+    long blank = scan_header_end(resp, len, 0);
+    if (blank < 0 || len - blank < 4 + 18) return NULL;
+    size_t hdr_end = blank + 4;
+    const unsigned char *gz = (const unsigned char *)resp + hdr_end;
+    size_t gz_len = len - hdr_end;
+
+    // The gzip trailer ends with the uncompressed size
+    uint32_t isize = (uint32_t)gz[gz_len - 4] | (uint32_t)gz[gz_len - 3] << 8 |
+                     (uint32_t)gz[gz_len - 2] << 16 | (uint32_t)gz[gz_len - 1] << 24;
+
+    unsigned long long start = thread_cpu_ns();
+    char *result = NULL;
+    if (coding == CODING_DEFLATE) {
+        // HTTP's "deflate" is the zlib format: the same raw deflate stream the
+        // gzip member carries, behind a zlib header and an adler32 trailer in
+        // place of gzip's. Only the checksum needs the inflated bytes.
+        size_t gz_hdr = gzip_header_length(gz, gz_len);
+        uLong adler;
+        if (gz_hdr == 0 || gz_len < gz_hdr + 8 || gzip_adler32(gz, gz_len, isize, &adler) < 0) {
+            return NULL;
+        }
+        size_t raw_len = gz_len - gz_hdr - 8;
+        size_t payload_len = 2 + raw_len + 4;
+
+        result = pool_alloc(hdr_end + 96 + payload_len + 1);
+        if (!result) return NULL;
+        size_t n = copy_kept_headers(resp, hdr_end, result);
+        n += snprintf(result + n, 96, "Content-Encoding: deflate\r\nContent-Length: %zu\r\n\r\n",
+                      payload_len);
+        unsigned char *out = (unsigned char *)result + n;
+        out[0] = 0x78;                          // deflate, 32K window
+        out[1] = 0x9c;                          // default level; 0x789c is a multiple of 31
+        memcpy(out + 2, gz + gz_hdr, raw_len);
+        out[2 + raw_len] = adler >> 24;
+        out[3 + raw_len] = adler >> 16;
+        out[4 + raw_len] = adler >> 8;
+        out[5 + raw_len] = adler;
+        n += payload_len;
+        result[n] = '\0';
+        *out_len = n;
+    } else {
+        char *plain = pool_alloc(isize + 1);
+        if (!plain) return NULL;
+
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        if (inflateInit2(&zs, 15 + 16) != Z_OK) {
+            pool_free(plain);
+            return NULL;
+        }
+        zs.next_in = (Bytef *)gz;
+        zs.avail_in = gz_len;
+        zs.next_out = (Bytef *)plain;
+        zs.avail_out = isize;
+        int rc = inflate(&zs, Z_FINISH);
+        inflateEnd(&zs);
+        if (rc != Z_STREAM_END || zs.total_out != isize) {
+            pool_free(plain);
+            return NULL;
+        }
+
+        result = pool_alloc(hdr_end + 96 + isize + 1);
+        if (result) {
+            size_t n = copy_kept_headers(resp, hdr_end, result);
+            n += snprintf(result + n, 96, "Content-Length: %zu\r\n\r\n", (size_t)isize);
+            memcpy(result + n, plain, isize);
+            n += isize;
+            result[n] = '\0';
+            *out_len = n;
+        }
+        pool_free(plain);
+    }
+
+    int type = classify(resp, hdr_end);
+    if (result && type >= 0) {
+        pthread_mutex_lock(&stats_mutex);
+        stats[type].decoded++;
+        stats[type].decode_ns += thread_cpu_ns() - start;
+        pthread_mutex_unlock(&stats_mutex);
+    }
+    return result;
+}
@@ -0,0 +1,26 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include "pool.h"
+
+// Text responses the origin sent uncompressed are gzipped once, when they
+// are cached, and only the gzip variant is stored. Hits go out as stored to
+// clients that accept gzip; other clients get a deflate or identity copy
+// decoded on the way out. Every variant carries Vary: Accept-Encoding.
+//
+//   PROXY_COMPRESS             "off" disables compression (default on)
+//   PROXY_COMPRESS_LEVEL       zlib level 1-9 (default 6)
+//   PROXY_COMPRESS_MIN_BYTES   smaller bodies are stored as they are (default 256)
+typedef enum {
+    CODING_IDENTITY,
+    CODING_GZIP,
+    CODING_DEFLATE
+} ContentCoding;
+
+void compress_init(void);
+int compress_response(const BufChain *in, BufChain *out);
+ContentCoding compress_pick_coding(const char *accept, size_t len);
+char* compress_transcode(const char *resp, size_t len, ContentCoding coding, size_t *out_len);
+
+#endif
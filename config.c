@@ -0,0 +1,22 @@
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// A positive integer from the environment, or def when unset or invalid
+long config_long(const char *name, long def) {
+    const char *value = getenv(name);
+    if (!value || !*value) return def;
+
+    char *end;
+    long n = strtol(value, &end, 10);
+    if (*end != '\0' || n <= 0) {
+        fprintf(stderr, "[-] Ignoring invalid %s=%s\n", name, value);
+        return def;
+    }
+    return n;
+}
+
+const char* config_string(const char *name, const char *def) {
+    const char *value = getenv(name);
+    return (value && *value) ? value : def;
+}
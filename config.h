@@ -0,0 +1,8 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+// Runtime settings are read from PROXY_* environment variables
+long config_long(const char *name, long def);
+const char* config_string(const char *name, const char *def);
+
+#endif
@@ -0,0 +1,236 @@
+#include "pool.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define NUM_CLASSES 7
+#define CLASS_LARGE NUM_CLASSES
+#define SLAB_BYTES (256 * 1024)
+#define THREAD_CACHE_MAX 8
+#define DEPOT_BATCH 4
+
+static const size_t class_sizes[NUM_CLASSES] = {
+    64, 256, 1024, 4096, 16384, 32768, 65536
+};
+
+// Sits in front of every block; 16 bytes keeps the payload 16-byte aligned
+typedef struct {
+    size_t cls;
+    size_t pad;
+} BlockHeader;
+
+typedef struct FreeBlock {
+    struct FreeBlock *next;
+} FreeBlock;
+
+typedef struct {
+    FreeBlock *head;
+    int count;
+} FreeList;
+
+static FreeList depot[NUM_CLASSES];
+static pthread_mutex_t depot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static size_t slab_bytes = 0;
+
+static __thread FreeList thread_cache[NUM_CLASSES];
+static __thread int thread_registered = 0;
+static __thread unsigned long thread_allocs = 0;
+static pthread_key_t flush_key;
+static pthread_once_t flush_once = PTHREAD_ONCE_INIT;
+
+static int size_class(size_t size) {
+    for (int i = 0; i < NUM_CLASSES; i++) {
+        if (size <= class_sizes[i]) return i;
+    }
+    return CLASS_LARGE;
+}
+
+// Give a thread's cached blocks back to the depot when the thread exits
+static void flush_thread_cache(void *unused) {
+    pthread_mutex_lock(&depot_mutex);
+    for (int i = 0; i < NUM_CLASSES; i++) {
+        FreeBlock *b = thread_cache[i].head;
+        while (b) {
+            FreeBlock *next = b->next;
+            b->next = depot[i].head;
+            depot[i].head = b;
+            depot[i].count++;
+            b = next;
+        }
+        thread_cache[i].head = NULL;
+        thread_cache[i].count = 0;
+    }
+    pthread_mutex_unlock(&depot_mutex);
+}
+
+static void create_flush_key(void) {
+    pthread_key_create(&flush_key, flush_thread_cache);
+}
+
+static void register_thread(void) {
+    pthread_once(&flush_once, create_flush_key);
+    // Any non-NULL value makes the destructor run at thread exit
+    pthread_setspecific(flush_key, (void *)1);
+    thread_registered = 1;
+}
+
+// Carve a new slab into blocks of class cls; called with depot_mutex held
+static int refill_depot(int cls) {
+    size_t block = sizeof(BlockHeader) + class_sizes[cls];
+    size_t count = SLAB_BYTES / block;
+    if (count == 0) count = 1;
+
+    char *slab = malloc(block * count);
+    if (!slab) return -1;
+    slab_bytes += block * count;
+
+    for (size_t i = 0; i < count; i++) {
+        BlockHeader *h = (BlockHeader *)(slab + i * block);
+        h->cls = cls;
+        FreeBlock *b = (FreeBlock *)(h + 1);
+        b->next = depot[cls].head;
+        depot[cls].head = b;
+        depot[cls].count++;
+    }
+    return 0;
+}
+
+void* pool_alloc(size_t size) {
+    int cls = size_class(size);
+    if (cls == CLASS_LARGE) {
+        BlockHeader *h = malloc(sizeof(BlockHeader) + size);
+        if (!h) return NULL;
+        h->cls = CLASS_LARGE;
+        return h + 1;
+    }
+
+    if (!thread_registered) register_thread();
+    thread_allocs++;
+
+    FreeList *local = &thread_cache[cls];
+    if (!local->head) {
+        pthread_mutex_lock(&depot_mutex);
+        if (!depot[cls].head && refill_depot(cls) < 0) {
+            pthread_mutex_unlock(&depot_mutex);
+            return NULL;
+        }
+        for (int i = 0; i < DEPOT_BATCH && depot[cls].head; i++) {
+            FreeBlock *b = depot[cls].head;
+            depot[cls].head = b->next;
+            depot[cls].count--;
+            b->next = local->head;
+            local->head = b;
+            local->count++;
+        }
+        pthread_mutex_unlock(&depot_mutex);
+    }
+
+    FreeBlock *b = local->head;
+    local->head = b->next;
+    local->count--;
+    return b;
+}
+
+void pool_free(void *p) {
+    if (!p) return;
+    BlockHeader *h = (BlockHeader *)p - 1;
+    if (h->cls == CLASS_LARGE) {
+        free(h);
+        return;
+    }
+
+    if (!thread_registered) register_thread();
+
+    int cls = (int)h->cls;
+    FreeList *local = &thread_cache[cls];
+    FreeBlock *b = p;
+    b->next = local->head;
+    local->head = b;
+    local->count++;
+
+    // Keep per-thread lists short; the overflow goes back to the depot
+    if (local->count > THREAD_CACHE_MAX) {
+        pthread_mutex_lock(&depot_mutex);
+        while (local->count > THREAD_CACHE_MAX / 2) {
+            FreeBlock *x = local->head;
+            local->head = x->next;
+            local->count--;
+            x->next = depot[cls].head;
+            depot[cls].head = x;
+            depot[cls].count++;
+        }
+        pthread_mutex_unlock(&depot_mutex);
+    }
+}
+
+// Total memory carved into slabs so far; slabs are kept for reuse
+size_t pool_slab_bytes(void) {
+    pthread_mutex_lock(&depot_mutex);
+    size_t n = slab_bytes;
+    pthread_mutex_unlock(&depot_mutex);
+    return n;
+}
+
+// Size-class blocks handed out to the calling thread; larger requests are
+// plain mallocs and left to whoever counts those
+unsigned long pool_thread_allocs(void) {
+    return thread_allocs;
+}
+
+void chain_init(BufChain *c) {
+    c->head = c->tail = NULL;
+    c->total = 0;
+}
+
+// Free space at the end of the chain, adding a segment when the last one is full
+char* chain_reserve(BufChain *c, size_t *avail) {
+    if (!c->tail || c->tail->len == c->tail->cap) {
+        Segment *s = pool_alloc(SEGMENT_ALLOC);
+        if (!s) return NULL;
+        s->next = NULL;
+        s->len = 0;
+        s->cap = SEGMENT_ALLOC - sizeof(Segment);
+        if (c->tail) c->tail->next = s;
+        else c->head = s;
+        c->tail = s;
+    }
+    *avail = c->tail->cap - c->tail->len;
+    return c->tail->data + c->tail->len;
+}
+
+void chain_commit(BufChain *c, size_t n) {
+    c->tail->len += n;
+    c->total += n;
+}
+
+int chain_append(BufChain *c, const char *data, size_t len) {
+    while (len > 0) {
+        size_t avail;
+        char *dst = chain_reserve(c, &avail);
+        if (!dst) return -1;
+        size_t n = len < avail ? len : avail;
+        memcpy(dst, data, n);
+        chain_commit(c, n);
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Copy the chain's contents into dst, which holds at least c->total bytes
+void chain_copy(const BufChain *c, char *dst) {
+    for (const Segment *s = c->head; s; s = s->next) {
+        memcpy(dst, s->data, s->len);
+        dst += s->len;
+    }
+}
+
+void chain_free(BufChain *c) {
+    Segment *s = c->head;
+    while (s) {
+        Segment *next = s->next;
+        pool_free(s);
+        s = next;
+    }
+    chain_init(c);
+}
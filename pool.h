@@ -0,0 +1,39 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+// Size-class slab allocator for I/O buffers and cache entries. Each thread
+// keeps a short free list per class and trades objects with a shared depot
+// in batches; requests above the largest class go straight to malloc.
+// Slabs are never returned to the system: a freed block goes back on a free
+// list, so the pool stays at its high-water mark once a burst has passed.
+void* pool_alloc(size_t size);
+void pool_free(void *p);
+size_t pool_slab_bytes(void);
+unsigned long pool_thread_allocs(void);
+
+// Fixed-size buffer segments chained together, used to accumulate responses
+// without doubling and copying one contiguous buffer
+#define SEGMENT_ALLOC 16384
+
+typedef struct Segment {
+    struct Segment *next;
+    size_t len;
+    size_t cap;
+    char data[];
+} Segment;
+
+typedef struct {
+    Segment *head, *tail;
+    size_t total;
+} BufChain;
+
+void chain_init(BufChain *c);
+char* chain_reserve(BufChain *c, size_t *avail);
+void chain_commit(BufChain *c, size_t n);
+int chain_append(BufChain *c, const char *data, size_t len);
+void chain_copy(const BufChain *c, char *dst);
+void chain_free(BufChain *c);
+
+#endif
@@ -0,0 +1,470 @@
+#include "prefetch.h"
+#include "proxy.h"
+#include "admission.h"
+#include "cache.h"
+#include "cluster.h"
+#include "config.h"
+#include "request.h"
+#include "scan.h"
+#include "timer.h"
+#include "gui.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#define MAX_URL 1024
+#define MAX_AUTHORITY 256
+#define MAX_WORKERS 16
+#define SCAN_LIMIT (256 * 1024)
+#define REPORT_EVERY 16
+
+typedef struct {
+    char url[MAX_URL];                  // absolute, as a browser would request it
+    char authority[MAX_AUTHORITY];      // host[:port] exactly as the page URL has it
+} PrefetchJob;
+
+typedef struct {
+    unsigned long queued;
+    unsigned long dropped;              // queue full, or no upstream slot to spare
+    unsigned long already_cached;
+    unsigned long over_budget;
+    unsigned long too_large;
+    unsigned long failed;
+    unsigned long no_room;              // the cache held only entries clients use
+    unsigned long fetched;
+    unsigned long long fetched_bytes;
+} PrefetchStats;
+
+static int enabled = 0;
+static int num_workers = 2;
+static long queue_cap = 64;
+static long per_origin = 2;
+static long max_links = 8;
+static long max_object = 512 * 1024;
+static long bytes_per_sec = 1024 * 1024;
+
+// Jobs are taken out of order when their origin is at its limit, so the
+// queue is a short array rather than a ring
+static PrefetchJob *queue;
+static int queue_len = 0;
+static PrefetchJob active[MAX_WORKERS];     // what each worker is fetching; empty url when idle
+static pthread_mutex_t prefetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+
+static PrefetchStats stats;
+static time_t budget_window = 0;
+static long budget_used = 0;
+
+// Whether a Content-Type line in the header block names HTML, and nothing
+// says the body is encoded
+static int is_plain_html(const char *head, size_t len) {
+    const char *end = head + len;
+    int html = 0;
+    for (const char *p = head; p < end; ) {
+        const char *lf = memchr(p, '\n', end - p);
+        size_t line = lf ? (size_t)(lf - p) : (size_t)(end - p);
+        if (line > 13 && strncasecmp(p, "content-type:", 13) == 0) {
+            for (size_t i = 13; i + 9 <= line; i++) {
+                if (strncasecmp(p + i, "text/html", 9) == 0) html = 1;
+            }
+        } else if (line > 17 && strncasecmp(p, "content-encoding:", 17) == 0) {
+            return 0;
+        }
+        p += line + 1;
+    }
+    return html;
+}
+
+static int tag_is(const char *p, const char *end, const char *name) {
+    size_t n = strlen(name);
+    return (size_t)(end - p) > n && strncasecmp(p, name, n) == 0 &&
+           (p[n] == ' ' || p[n] == '\t' || p[n] == '\n' || p[n] == '\r' || p[n] == '/');
+}
+
+static int tag_has(const char *p, const char *end, const char *word) {
+    size_t n = strlen(word);
+    for (; p + n <= end; p++) {
+        if (strncasecmp(p, word, n) == 0) return 1;
+    }
+    return 0;
+}
+
+// Value of attribute name inside a tag, quoted or not
+static const char* find_attr(const char *p, const char *end, const char *name, size_t *len) {
+    size_t n = strlen(name);
+    for (const char *a = p + 1; a + n < end; a++) {
+        if (!(a[-1] == ' ' || a[-1] == '\t' || a[-1] == '\n' || a[-1] == '\r')) continue;
+        if (strncasecmp(a, name, n) != 0) continue;
+        const char *v = a + n;
+        while (v < end && (*v == ' ' || *v == '\t')) v++;
+        if (v == end || *v != '=') continue;
+        v++;
+        while (v < end && (*v == ' ' || *v == '\t')) v++;
+        if (v == end) return NULL;
+
+        const char *e;
+        if (*v == '"' || *v == '\'') {
+            e = memchr(v + 1, *v, end - v - 1);
+            if (!e) return NULL;
+            v++;
+        } else {
+            e = v;
+            while (e < end && *e != ' ' && *e != '\t' && *e != '\n' && *e != '\r') e++;
+        }
+        *len = e - v;
+        return v;
+    }
+    return NULL;
+}
+
+// Resolve a link against the page into an absolute same-origin URL.
+// Returns -1 for other origins, other schemes and anything we would not
+// request the way a browser does.
+static int resolve_link(const char *authority, const char *page_path, const char *v, size_t vlen,
+                        char *url, size_t urlsize) {
+    char link[MAX_URL];
+    size_t n = 0;
+    for (size_t i = 0; i < vlen && n < sizeof(link) - 1; i++) {
+        if (v[i] == '#') break;
+        link[n++] = v[i];
+        if (v[i] == '&' && vlen - i >= 5 && strncmp(v + i, "&amp;", 5) == 0) i += 4;
+    }
+    link[n] = '\0';
+    while (n > 0 && (link[n - 1] == ' ' || link[n - 1] == '\t')) link[--n] = '\0';
+    if (n == 0) return -1;
+
+    const char *path;
+    char joined[MAX_URL];
+    if (strncasecmp(link, "http://", 7) == 0) {
+        const char *auth = link + 7;
+        size_t auth_len = strcspn(auth, "/?");
+        if (auth_len != strlen(authority) || strncasecmp(auth, authority, auth_len) != 0) return -1;
+        path = auth[auth_len] == '/' ? auth + auth_len : "/";
+    } else if (link[0] == '/' && link[1] == '/') {
+        return -1;
+    } else if (link[strcspn(link, ":/?")] == ':') {
+        return -1;      // https:, data:, javascript:, ...
+    } else if (link[0] == '/') {
+        path = link;
+    } else {
+        const char *rel = strncmp(link, "./", 2) == 0 ? link + 2 : link;
+        size_t dir_len = strcspn(page_path, "?");
+        while (dir_len > 0 && page_path[dir_len - 1] != '/') dir_len--;
+        if (snprintf(joined, sizeof(joined), "%.*s%s", (int)dir_len, page_path, rel) >= (int)sizeof(joined)) {
+            return -1;
+        }
+        path = joined;
+    }
+
+    // Dot segments would be normalized by the browser and miss our key
+    if (strstr(path, "/./") || strstr(path, "/../")) return -1;
+    if (snprintf(url, urlsize, "http://%s%s", authority, path) >= (int)urlsize) return -1;
+    return 0;
+}
+
+static int origin_load(const char *authority) {
+    int n = 0;
+    for (int w = 0; w < num_workers; w++) {
+        if (active[w].url[0] && strcmp(active[w].authority, authority) == 0) n++;
+    }
+    return n;
+}
+
+static int already_queued(const char *url) {
+    for (int i = 0; i < queue_len; i++) {
+        if (strcmp(queue[i].url, url) == 0) return 1;
+    }
+    for (int w = 0; w < num_workers; w++) {
+        if (strcmp(active[w].url, url) == 0) return 1;
+    }
+    return 0;
+}
+
+static void enqueue(const char *url, const char *authority) {
+    char key[MAX_URL * 2];
+    char owner[256];
+    int owner_port;
+    build_cache_key("GET", url, NULL, key, sizeof(key));
+    // Another member owns this key; its cache is where the object belongs
+    if (cluster_owner(key, owner, sizeof(owner), &owner_port)) return;
+
+    if (cache_contains(key)) {
+        pthread_mutex_lock(&prefetch_mutex);
+        stats.already_cached++;
+        pthread_mutex_unlock(&prefetch_mutex);
+        return;
+    }
+
+    pthread_mutex_lock(&prefetch_mutex);
+    if (!already_queued(url)) {
+        if (queue_len == queue_cap) {
+            stats.dropped++;
+        } else {
+            PrefetchJob *job = &queue[queue_len++];
+            snprintf(job->url, sizeof(job->url), "%s", url);
+            snprintf(job->authority, sizeof(job->authority), "%s", authority);
+            stats.queued++;
+            pthread_cond_signal(&prefetch_cond);
+        }
+    }
+    pthread_mutex_unlock(&prefetch_mutex);
+}
+
+// Queue the same-origin subresources of a cacheable HTML page fetched from url
+void prefetch_page(const char *url, const BufChain *response) {
+    if (!enabled || !response->head || strncmp(url, "http://", 7) != 0) return;
+
+    const Segment *first = response->head;
+    long blank = scan_header_end(first->data, first->len, 0);
+    if (blank < 0 || !is_plain_html(first->data, blank)) return;
+
+    char authority[MAX_AUTHORITY];
+    const char *auth = url + 7;
+    size_t auth_len = strcspn(auth, "/");
+    if (auth_len == 0 || auth_len >= sizeof(authority)) return;
+    memcpy(authority, auth, auth_len);
+    authority[auth_len] = '\0';
+    const char *page_path = auth[auth_len] ? auth + auth_len : "/";
+
+    // Scan a flat copy of the start of the body
+    size_t body_len = response->total - (blank + 4);
+    if (body_len > SCAN_LIMIT) body_len = SCAN_LIMIT;
+    char *html = pool_alloc(body_len + 1);
+    if (!html) return;
+    size_t n = 0, off = blank + 4;
+    for (const Segment *s = first; s && n < body_len; s = s->next, off = 0) {
+        size_t take = s->len - off < body_len - n ? s->len - off : body_len - n;
+        memcpy(html + n, s->data + off, take);
+        n += take;
+    }
+
+    int links = 0;
+    const char *end = html + n;
+    for (const char *p = memchr(html, '<', n); p && links < max_links; p = memchr(p, '<', end - p)) {
+        p++;
+        const char *tag_end = memchr(p, '>', end - p);
+        if (!tag_end) break;
+
+        const char *attr = NULL;
+        if (tag_is(p, tag_end, "script") || tag_is(p, tag_end, "img")) {
+            attr = "src";
+        } else if (tag_is(p, tag_end, "link") &&
+                   (tag_has(p, tag_end, "stylesheet") || tag_has(p, tag_end, "preload") ||
+                    tag_has(p, tag_end, "icon"))) {
+            attr = "href";
+        }
+
+        size_t vlen;
+        const char *v = attr ? find_attr(p, tag_end, attr, &vlen) : NULL;
+        char link[MAX_URL];
+        if (v && resolve_link(authority, page_path, v, vlen, link, sizeof(link)) == 0) {
+            enqueue(link, authority);
+            links++;
+        }
+        p = tag_end + 1;
+    }
+    pool_free(html);
+
+    if (links > 0) printf("[PREFETCH] %d links from %s\n", links, url);
+}
+
+static void report(void) {
+    unsigned long hits, wasted;
+    unsigned long long wasted_bytes;
+    cache_prefetch_stats(&hits, &wasted, &wasted_bytes);
+
+    char message[512];
+    pthread_mutex_lock(&prefetch_mutex);
+    snprintf(message, sizeof(message),
+             "[PREFETCH] fetched %lu (%llu bytes), %lu served (%.1f%%), %lu evicted unused (%llu bytes wasted) | "
+             "queued %lu, dropped %lu, already cached %lu, over budget %lu, too large %lu, failed %lu, no room %lu",
+             stats.fetched, stats.fetched_bytes, hits, stats.fetched ? 100.0 * hits / stats.fetched : 0.0,
+             wasted, wasted_bytes, stats.queued, stats.dropped, stats.already_cached,
+             stats.over_budget, stats.too_large, stats.failed, stats.no_room);
+    pthread_mutex_unlock(&prefetch_mutex);
+
+    printf("%s\n", message);
+    char *msg = strdup(message);
+    if (msg) g_idle_add(log_message_idle, msg);
+}
+
+// Fetch one URL straight from its origin into the cache. Returns the
+// response size, 0 when the cache had no room for it, or -1; received is
+// set to the bytes read either way.
+static long fetch_into_cache(const PrefetchJob *job, long *received) {
+    char host[MAX_AUTHORITY];
+    int port = 80;
+    snprintf(host, sizeof(host), "%s", job->authority);
+    char *colon = strchr(host, ':');
+    if (colon) {
+        *colon = '\0';
+        port = atoi(colon + 1);
+    }
+    *received = 0;
+    if (is_blocked(host)) return -1;
+
+    Deadline d;
+    deadline_init(&d);
+    int fd = connect_to_host(host, port, &d);
+    if (fd < 0) return -1;
+
+    const char *path = job->url + 7 + strlen(job->authority);
+    char request[MAX_URL + MAX_AUTHORITY + 64];
+    int request_len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n",
+                               *path ? path : "/", job->authority);
+
+    BufChain response;
+    chain_init(&response);
+    size_t reserved = 0;
+    int ok = send_all(fd, request, request_len) == 0;
+    deadline_arm(&d, TIMEOUT_FIRST_BYTE, fd, -1);
+    while (ok) {
+        size_t room;
+        char *dst = chain_reserve(&response, &room);
+        if (!dst) {
+            ok = 0;
+            break;
+        }
+        ssize_t n = recv(fd, dst, room, 0);
+        if (n <= 0) break;
+        if (response.total == 0) deadline_arm(&d, TIMEOUT_BODY_PROGRESS, fd, -1);
+        else deadline_touch(&d);
+        chain_commit(&response, n);
+        // Held bytes count against the same pending budget as client misses
+        if (admission_reserve_bytes(n) < 0) {
+            admission_count_cache_skipped();
+            ok = 0;
+            break;
+        }
+        reserved += n;
+        if ((long)response.total > max_object) {
+            pthread_mutex_lock(&prefetch_mutex);
+            stats.too_large++;
+            pthread_mutex_unlock(&prefetch_mutex);
+            ok = 0;
+        }
+    }
+    if (deadline_disarm(&d)) ok = 0;
+    close(fd);
+
+    // Same rules as the relay, since both store through cache_store_response
+    long size = -1;
+    if (ok) {
+        char key[MAX_URL * 2];
+        build_cache_key("GET", job->url, NULL, key, sizeof(key));
+        int rc = cache_store_response(key, &response, CACHE_PREFETCHED);
+        if (rc == 0) {
+            size = response.total;
+        } else if (rc == CACHE_NOT_STORED) {
+            pthread_mutex_lock(&prefetch_mutex);
+            stats.no_room++;
+            pthread_mutex_unlock(&prefetch_mutex);
+            size = 0;
+        }
+    }
+    *received = response.total;
+    admission_release_bytes(reserved);
+    chain_free(&response);
+    return size;
+}
+
+static void* prefetch_worker(void *arg) {
+    int w = (int)(long)arg;
+    while (1) {
+        pthread_mutex_lock(&prefetch_mutex);
+        int pick = -1;
+        while (pick < 0) {
+            for (int i = 0; i < queue_len && pick < 0; i++) {
+                if (origin_load(queue[i].authority) < per_origin) pick = i;
+            }
+            if (pick < 0) pthread_cond_wait(&prefetch_cond, &prefetch_mutex);
+        }
+        active[w] = queue[pick];
+        memmove(&queue[pick], &queue[pick + 1], (queue_len - pick - 1) * sizeof(PrefetchJob));
+        queue_len--;
+
+        // Spend from this second's byte budget; skip the job once it is gone.
+        // The largest object allowed is charged up front, so workers starting
+        // together cannot all see room, and corrected when the fetch ends.
+        time_t now = time(NULL);
+        if (now != budget_window) {
+            budget_window = now;
+            budget_used = 0;
+        }
+        time_t window = budget_window;
+        long charged = 0;
+        int over_budget = budget_used >= bytes_per_sec;
+        if (over_budget) {
+            stats.over_budget++;
+        } else {
+            charged = max_object;
+            budget_used += charged;
+        }
+        pthread_mutex_unlock(&prefetch_mutex);
+
+        // Prefetch only uses upstream capacity no client is waiting for
+        int admitted = !over_budget && admission_try_acquire_upstream() == 0;
+        long size = 0, received = 0;
+        if (admitted) {
+            size = fetch_into_cache(&active[w], &received);
+            admission_release_upstream();
+        }
+
+        pthread_mutex_lock(&prefetch_mutex);
+        // A fetch that ran into a later second is charged to that one in full
+        budget_used += budget_window == window ? received - charged : received;
+        if (!over_budget && !admitted) {
+            stats.dropped++;
+        } else if (size > 0) {
+            stats.fetched++;
+            stats.fetched_bytes += size;
+        } else if (size < 0) {
+            stats.failed++;
+        }
+        int fetched = size > 0 ? (int)stats.fetched : 0;
+        active[w].url[0] = '\0';
+        // A slot for this origin just opened up
+        pthread_cond_broadcast(&prefetch_cond);
+        pthread_mutex_unlock(&prefetch_mutex);
+
+        if (fetched && fetched % REPORT_EVERY == 0) report();
+    }
+    return NULL;
+}
+
+void prefetch_init(void) {
+    const char *mode = config_string("PROXY_PREFETCH", "off");
+    enabled = strcmp(mode, "on") == 0 || strcmp(mode, "1") == 0;
+    if (!enabled) return;
+
+    num_workers = config_long("PROXY_PREFETCH_WORKERS", 2);
+    if (num_workers > MAX_WORKERS) num_workers = MAX_WORKERS;
+    queue_cap = config_long("PROXY_PREFETCH_QUEUE", 64);
+    per_origin = config_long("PROXY_PREFETCH_PER_ORIGIN", 2);
+    max_links = config_long("PROXY_PREFETCH_MAX_LINKS", 8);
+    max_object = config_long("PROXY_PREFETCH_MAX_OBJECT", 512 * 1024);
+    bytes_per_sec = config_long("PROXY_PREFETCH_BYTES_PER_SEC", 1024 * 1024);
+
+    queue = calloc(queue_cap, sizeof(PrefetchJob));
+    if (!queue) {
+        enabled = 0;
+        return;
+    }
+    for (long w = 0; w < num_workers; w++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, prefetch_worker, (void *)w) == 0) {
+            pthread_detach(thread);
+        }
+    }
+    printf("[PREFETCH] %d workers, queue %ld, %ld per origin, %ld links per page, %ld bytes/s\n",
+           num_workers, queue_cap, per_origin, max_links, bytes_per_sec);
+}
+
+int prefetch_enabled(void) {
+    return enabled;
+}
@@ -0,0 +1,25 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include "pool.h"
+
+// Optional background prefetching. Cacheable HTML pages are scanned for
+// same-origin subresources (scripts, images, stylesheets), which worker
+// threads then fetch into the cache before the browser asks for them.
+// A fetch takes an upstream slot only when no client needs it, and its bytes
+// count against the admission pending budget; otherwise the link is dropped.
+// Prefetched objects enter the cache at its LRU end and only replace other
+// prefetched objects nobody has asked for, never entries clients have used.
+//
+//   PROXY_PREFETCH               "on" enables it (default off)
+//   PROXY_PREFETCH_WORKERS       fetching threads (default 2)
+//   PROXY_PREFETCH_QUEUE         queued links; extras are dropped (default 64)
+//   PROXY_PREFETCH_PER_ORIGIN    concurrent fetches per origin (default 2)
+//   PROXY_PREFETCH_MAX_LINKS     links taken from one page (default 8)
+//   PROXY_PREFETCH_MAX_OBJECT    largest object fetched, in bytes (default 512 KB)
+//   PROXY_PREFETCH_BYTES_PER_SEC byte budget across all workers (default 1 MB)
+void prefetch_init(void);
+int prefetch_enabled(void);
+void prefetch_page(const char *url, const BufChain *response);
+
+#endif
@@ -1,5 +1,14 @@
 #include "proxy.h"
 #include "cache.h"
+#include "request.h"
+#include "scan.h"
+#include "pool.h"
+#include "admission.h"
+#include "cluster.h"
+#include "config.h"
+#include "timer.h"
+#include "compress.h"
+#include "prefetch.h"
 #include "gui.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,12 +23,23 @@
 #include <fcntl.h>
 #include <sys/select.h>
 #include <stdbool.h>
+#include <signal.h>
 
 #define PORT 8080
 #define BUFFER_SIZE 8192
-
-// Utility: Build cache key for GET/POST
-void build_cache_key(const char *method, const char *url, const char *body, char *key, size_t keysize) {
+#define CACHE_KEY_SIZE (BUFFER_SIZE * 2)
+#define THREAD_STACK_SIZE (256 * 1024)
+
+// What the accept loop hands to a connection thread
+typedef struct {
+    int fd;
+    bool hits_only;     // admitted above the soft limit: serve from cache or shed
+} ClientConn;
+
+// Utility: Build cache key for GET/POST. Returns -1 when the key did not fit
+// in keysize; a truncated key must not be used, since it would match other
+// requests that differ only past the cut.
+int build_cache_key(const char *method, const char *url, const char *body, char *key, size_t keysize) {
     char normalized_url[1024] = {0};
     char host[512] = {0};
     char path[1024] = "/";
@@ -61,16 +81,17 @@ void build_cache_key(const char *method, const char *url, const char *body, char
     printf("[URL DEBUG] Normalized URL: %s\n", normalized_url);
     
     // Build final cache key
+    int len;
     if (strcmp(method, "GET") == 0) {
-        strncpy(key, normalized_url, keysize - 1);
-        key[keysize - 1] = '\0';
+        len = snprintf(key, keysize, "%s", normalized_url);
     } else if (strcmp(method, "POST") == 0) {
-        snprintf(key, keysize, "%s %s", normalized_url, body ? body : "");
+        len = snprintf(key, keysize, "%s %s", normalized_url, body ? body : "");
     } else {
-        snprintf(key, keysize, "%s %s", method, normalized_url);
+        len = snprintf(key, keysize, "%s %s", method, normalized_url);
     }
     
     printf("[URL DEBUG] Final cache key: %s\n", key);
+    return len < 0 || (size_t)len >= keysize ? -1 : 0;
 }
 
 // Check if the host is blocked
@@ -88,31 +109,42 @@ int is_blocked(const char *host) {
     return 0;
 }
 
-// Connect to the remote host
-static int connect_to_host(const char *host, int port) {
-    struct hostent *server = gethostbyname(host);
-    if (!server) return -1;
-
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) return -1;
-
-    struct sockaddr_in serv_addr;
-    memset(&serv_addr, 0, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(port);
-    memcpy(&serv_addr.sin_addr.s_addr, server->h_addr_list[0], server->h_length);
+// Connect to the remote host, bounded by the upstream-connect deadline.
+// The deadline starts before name resolution so a slow resolver uses up
+// the same budget; getaddrinfo itself cannot be interrupted, but once it
+// returns after the deadline the connect is not attempted.
+int connect_to_host(const char *host, int port, Deadline *d) {
+    deadline_arm(d, TIMEOUT_UPSTREAM_CONNECT, -1, -1);
+
+    struct addrinfo hints, *res;
+    char service[16];
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host, service, &hints, &res) != 0) {
+        deadline_disarm(d);
+        return -1;
+    }
 
-    if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-        close(sockfd);
+    int sockfd = socket(res->ai_family, SOCK_STREAM, 0);
+    int rc = -1;
+    if (sockfd >= 0 && !deadline_cover(d, sockfd, -1)) {
+        rc = connect(sockfd, res->ai_addr, res->ai_addrlen);
+    }
+    freeaddrinfo(res);
+    if (deadline_disarm(d) || rc < 0) {
+        if (sockfd >= 0) close(sockfd);
         return -1;
     }
     return sockfd;
 }
 
-// Tunnel HTTP/HTTPS data
-static void tunnel_data(int client_fd, int remote_fd) {
+// Tunnel HTTP/HTTPS data until either side closes or it sits idle too long
+static void tunnel_data(int client_fd, int remote_fd, Deadline *d) {
     char buffer[BUFFER_SIZE];
     fd_set fds;
+    deadline_arm(d, TIMEOUT_TUNNEL_IDLE, client_fd, remote_fd);
     while (1) {
         FD_ZERO(&fds);
         FD_SET(client_fd, &fds);
@@ -130,27 +162,178 @@ static void tunnel_data(int client_fd, int remote_fd) {
             if (n <= 0) break;
             send(client_fd, buffer, n, 0);
         }
+        deadline_touch(d);
     }
+    deadline_disarm(d);
     close(remote_fd);
 }
 
-// Handle HTTP/HTTPS requests
-void *handle_client(void *arg) {
-    int client_socket = *(int *)arg;
-    free(arg);
+// Drop a partly collected response and give its bytes back to the pending
+// budget at once; the rest of the relay may take a long time
+static void stop_collecting(BufChain *response, bool *collecting, size_t *reserved) {
+    chain_free(response);
+    admission_release_bytes(*reserved);
+    *reserved = 0;
+    *collecting = false;
+}
 
-    char buffer[BUFFER_SIZE+1];
-    int bytes_received = recv(client_socket, buffer, BUFFER_SIZE, 0);
-    if (bytes_received <= 0) {
-        close(client_socket);
-        return NULL;
+// Send the request to the origin and relay the response to the client,
+// collecting it for the cache when should_cache is set. Closes remote_socket.
+static void relay_from_origin(int client_socket, int remote_socket, HttpRequest *req,
+                              const char *request_line, size_t request_line_len,
+                              bool should_cache, const char *cache_key, const char *url, Deadline *d) {
+    char client_ip[INET_ADDRSTRLEN] = "unknown";
+    struct sockaddr_in client_addr;
+    socklen_t client_addr_len = sizeof(client_addr);
+    if (getpeername(client_socket, (struct sockaddr *)&client_addr, &client_addr_len) == 0) {
+        inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, sizeof(client_ip));
+    }
+
+    // Sending the request waits on the client for its body
+    deadline_arm(d, TIMEOUT_CLIENT_IDLE, client_socket, remote_socket);
+    if (request_forward(req, remote_socket, request_line, request_line_len, client_ip) < 0 ||
+        request_relay_body(req, client_socket, remote_socket, d) < 0) {
+        deadline_disarm(d);
+        close(remote_socket);
+        return;
+    }
+
+    // Only set up caching for non-CONNECT requests. The response is received
+    // straight into fixed-size pool segments instead of a doubling buffer.
+    BufChain response;
+    chain_init(&response);
+    bool collecting = should_cache;
+    size_t reserved = 0;
+    // req->buf doubles as the relay buffer below, so look at the method now
+    bool is_get = req->method.len == 3 && memcmp(req->buf + req->method.off, "GET", 3) == 0;
+    bool headers_complete = false;
+    bool is_success = false;
+
+    // The origin closes when it is done (we sent Connection: close); a stalled
+    // origin is cut off by the first-byte and then the body-progress deadline.
+    // Until the first byte only the origin side is shut down, so the client
+    // can still be told it timed out.
+    int bytes_received;
+    bool first_byte = true;
+    deadline_arm(d, TIMEOUT_FIRST_BYTE, remote_socket, -1);
+
+    while (1) {
+        char *dst = req->buf;
+        size_t room = BUFFER_SIZE;
+        if (collecting) {
+            dst = chain_reserve(&response, &room);
+            if (!dst) {
+                printf("[CACHE DEBUG] Failed to add a response segment\n");
+                stop_collecting(&response, &collecting, &reserved);
+                dst = req->buf;
+                room = BUFFER_SIZE;
+            }
+        }
+
+        bytes_received = recv(remote_socket, dst, room, 0);
+        if (bytes_received <= 0) break;
+        if (first_byte) {
+            deadline_arm(d, TIMEOUT_BODY_PROGRESS, remote_socket, client_socket);
+            first_byte = false;
+        }
+
+        // Forward to client immediately
+        send(client_socket, dst, bytes_received, 0);
+        deadline_touch(d);
+        
+        // Process for caching if needed
+        if (collecting) {
+            // Headers must fit in the first segment; a delimiter may straddle
+            // the previous chunk by up to 3 bytes
+            Segment *first = response.head;
+            size_t scan_from = first->len >= 3 ? first->len - 3 : 0;
+            chain_commit(&response, bytes_received);
+
+            // Collected bytes count against the pending-bytes budget
+            if (admission_reserve_bytes(bytes_received) < 0) {
+                printf("[CACHE DEBUG] Pending bytes over budget, stopping cache\n");
+                admission_count_cache_skipped();
+                stop_collecting(&response, &collecting, &reserved);
+                continue;
+            }
+            reserved += bytes_received;
+            
+            // Check headers once they are complete, scanning only the new bytes
+            if (!headers_complete) {
+                if (response.tail != first) {
+                    printf("[CACHE DEBUG] Response headers too large, stopping cache\n");
+                    stop_collecting(&response, &collecting, &reserved);
+                } else if (scan_header_end(first->data, first->len, scan_from) >= 0) {
+                    headers_complete = true;
+                    if (cache_status_ok(first->data, first->len)) {
+                        is_success = true;
+                        printf("[CACHE DEBUG] Got successful response, continuing to cache\n");
+                    } else {
+                        // Keep relaying to the client, just stop collecting for the cache
+                        printf("[CACHE DEBUG] Not a 200 response, stopping cache\n");
+                        stop_collecting(&response, &collecting, &reserved);
+                    }
+                }
+            }
+        }
+    }
+
+    // A response cut off by a deadline is incomplete and never cached
+    if (deadline_disarm(d)) {
+        collecting = false;
+        if (first_byte) {
+            const char *timeout_msg = "HTTP/1.1 504 Gateway Timeout\r\nContent-Length: 0\r\n\r\n";
+            send(client_socket, timeout_msg, strlen(timeout_msg), MSG_NOSIGNAL);
+        }
+    }
+
+    // Cache if we have a complete successful response
+    if (collecting && is_success && cache_store_response(cache_key, &response, 0) == 0) {
+        // Pages fetched by GET may pull their subresources in behind them
+        if (prefetch_enabled() && is_get) {
+            prefetch_page(url, &response);
+        }
+    }
+
+    admission_release_bytes(reserved);
+    chain_free(&response);
+    close(remote_socket);
+}
+
+// Serve one client connection; buffer and cache_key come from the pool. The
+// caller closes client_socket once the deadline is disarmed.
+static void serve_client(int client_socket, bool hits_only, char *buffer, char *cache_key, Deadline *d) {
+    HttpRequest req;
+    // Leave room for a terminating NUL after the received bytes
+    request_init(&req, buffer, REQUEST_BUFFER_SIZE - 1);
+
+    // The whole header block must arrive within the client-idle timeout
+    deadline_arm(d, TIMEOUT_CLIENT_IDLE, client_socket, -1);
+
+    // Read until the whole header block has arrived, however many recv calls it takes
+    int rc = request_read_headers(&req, client_socket);
+    if (rc != REQ_COMPLETE) {
+        const char *error_msg = NULL;
+        if (rc == REQ_TOO_LARGE) error_msg = "HTTP/1.1 431 Request Header Fields Too Large\r\n\r\n";
+        else if (rc == REQ_ERROR) error_msg = "HTTP/1.1 400 Bad Request\r\n\r\n";
+        if (error_msg) send(client_socket, error_msg, strlen(error_msg), MSG_NOSIGNAL);
+        return;
     }
-    buffer[bytes_received] = '\0';
+    buffer[req.len] = '\0';
 
+    // No method we handle is anywhere near 16 bytes, so a longer one is unknown
     char method[16], url[1024], protocol[16];
-    if (sscanf(buffer, "%15s %1023s %15s", method, url, protocol) != 3) {
-        close(client_socket);
-        return NULL;
+    const char *error_msg = NULL;
+    if (request_slice_copy(&req, req.method, method, sizeof(method)) < 0) {
+        error_msg = "HTTP/1.1 501 Not Implemented\r\n\r\n";
+    } else if (request_slice_copy(&req, req.target, url, sizeof(url)) < 0) {
+        error_msg = "HTTP/1.1 414 URI Too Long\r\n\r\n";
+    } else if (request_slice_copy(&req, req.version, protocol, sizeof(protocol)) < 0) {
+        error_msg = "HTTP/1.1 400 Bad Request\r\n\r\n";
+    }
+    if (error_msg) {
+        send(client_socket, error_msg, strlen(error_msg), MSG_NOSIGNAL);
+        return;
     }
 
     // Log the request with cache status
@@ -158,27 +341,55 @@ void *handle_client(void *arg) {
     char cache_status[32];
 
     // Build normalized cache key
-    char cache_key[BUFFER_SIZE * 2];
-    char *body = NULL;
+    bool is_connect = (strcmp(method, "CONNECT") == 0);
     
     // Skip caching for CONNECT requests
-    bool should_cache = (strcmp(method, "CONNECT") != 0);
+    bool should_cache = !is_connect;
     
     if (should_cache) {
         if (strcmp(method, "POST") == 0) {
-            char *body_start = strstr(buffer, "\r\n\r\n");
-            if (body_start) {
-                body = body_start + 4;
+            // Chunked, larger than the buffer or the key, or holding a NUL that
+            // would end the key early: never key on a partial body
+            const char *body = buffer + req.header_end;
+            if (request_body_in_buffer(&req) && !memchr(body, '\0', req.content_length)) {
+                // Terminate the body in place for the key, then restore the byte after it
+                size_t body_end = req.header_end + req.content_length;
+                char saved = buffer[body_end];
+                buffer[body_end] = '\0';
+                if (build_cache_key(method, url, body, cache_key, CACHE_KEY_SIZE) < 0) should_cache = false;
+                buffer[body_end] = saved;
             } else {
-                body = "";
+                should_cache = false;
             }
-            build_cache_key(method, url, body, cache_key, sizeof(cache_key));
-        } else {
-            build_cache_key(method, url, NULL, cache_key, sizeof(cache_key));
+        } else if (build_cache_key(method, url, NULL, cache_key, CACHE_KEY_SIZE) < 0) {
+            should_cache = false;
         }
+    }
 
+    if (should_cache) {
         // Check cache first
-        char *cached_response = find_in_cache(cache_key);
+        size_t cached_len = 0;
+        int cached_flags = 0;
+        char *cached_response = find_in_cache(cache_key, &cached_len, &cached_flags);
+
+        // Entries we gzipped are decoded for clients that do not accept gzip
+        if (cached_response && (cached_flags & CACHE_GZIP)) {
+            const Header *accept = request_find_header(&req, "accept-encoding");
+            ContentCoding coding = accept ? compress_pick_coding(buffer + accept->value.off, accept->value.len)
+                                          : CODING_IDENTITY;
+            if (coding != CODING_GZIP) {
+                size_t decoded_len;
+                char *decoded = compress_transcode(cached_response, cached_len, coding, &decoded_len);
+                pool_free(cached_response);
+                cached_response = decoded;
+                cached_len = decoded_len;
+                if (!decoded) {
+                    // Treat the entry as a miss and fetch a fresh copy
+                    printf("[CACHE DEBUG] Failed to decode cached response, dropping it\n");
+                    remove_from_cache(cache_key);
+                }
+            }
+        }
         if (cached_response) {
             strcpy(cache_status, "CACHE_HIT");
             // Create combined log message
@@ -186,14 +397,22 @@ void *handle_client(void *arg) {
             char *request_msg = strdup(logbuf);
             g_idle_add(log_message_idle, request_msg);
 
-            send(client_socket, cached_response, strlen(cached_response), 0);
-            free(cached_response);
-            close(client_socket);
-            return NULL;
+            // A client that stops reading is cut off after the client-idle timeout
+            deadline_arm(d, TIMEOUT_CLIENT_IDLE, client_socket, -1);
+            send_all(client_socket, cached_response, cached_len);
+            pool_free(cached_response);
+            return;
         }
         strcpy(cache_status, "CACHE_MISS");
     } else {
-        strcpy(cache_status, "CONNECT");
+        strcpy(cache_status, is_connect ? "CONNECT" : "NO_CACHE");
+    }
+
+    // Over the soft limit only cache hits are served; everything else is shed
+    if (hits_only) {
+        admission_count_shed_hits_only();
+        admission_send_503(client_socket);
+        return;
     }
 
     // Create combined log message
@@ -202,15 +421,12 @@ void *handle_client(void *arg) {
     g_idle_add(log_message_idle, request_msg);
 
     // Handle HTTPS requests (CONNECT method)
-    if (strcmp(method, "CONNECT") == 0) {
+    if (is_connect) {
         char host[512] = {0};
         int port = 443;
 
         char *colon = strchr(url, ':');
-        if (!colon) {
-            close(client_socket);
-            return NULL;
-        }
+        if (!colon) return;
 
         size_t host_len = colon - url;
         if (host_len >= sizeof(host)) host_len = sizeof(host) - 1;
@@ -222,23 +438,27 @@ void *handle_client(void *arg) {
         if (is_blocked(host)) {
             const char *forbidden = "HTTP/1.1 403 Forbidden\r\n\r\n";
             send(client_socket, forbidden, strlen(forbidden), 0);
-            close(client_socket);
-            return NULL;
+            return;
         }
 
-        int remote_socket = connect_to_host(host, port);
+        int remote_socket = connect_to_host(host, port, d);
         if (remote_socket < 0) {
             const char *fail_msg = "HTTP/1.1 502 Bad Gateway\r\n\r\n";
             send(client_socket, fail_msg, strlen(fail_msg), 0);
-            close(client_socket);
-            return NULL;
+            return;
         }
 
         const char *connection_established = "HTTP/1.1 200 Connection Established\r\n\r\n";
         send(client_socket, connection_established, strlen(connection_established), 0);
-        tunnel_data(client_socket, remote_socket);
-        close(client_socket);
-        return NULL;
+
+        // Anything the client sent right behind the CONNECT headers belongs to the tunnel
+        size_t early = request_body_buffered(&req);
+        if (early > 0 && send_all(remote_socket, buffer + req.header_end, early) < 0) {
+            close(remote_socket);
+            return;
+        }
+        tunnel_data(client_socket, remote_socket, d);
+        return;
     }
 
     // Handle HTTP requests (GET, POST, etc.)
@@ -264,137 +484,118 @@ void *handle_client(void *arg) {
         strcpy(path, "/");
     }
 
+    // Split an explicit port off the host (http://host:port/path)
+    char *port_sep = strchr(host, ':');
+    if (port_sep) {
+        *port_sep = '\0';
+        port = atoi(port_sep + 1);
+    }
+
     if (is_blocked(host)) {
         const char *forbidden = "HTTP/1.1 403 Forbidden\r\n\r\n";
         send(client_socket, forbidden, strlen(forbidden), 0);
-        close(client_socket);
-        return NULL;
+        return;
     }
 
-    int remote_socket = connect_to_host(host, port);
-    if (remote_socket < 0) {
-        close(client_socket);
-        return NULL;
+    if (admission_acquire_upstream() < 0) {
+        admission_send_503(client_socket);
+        return;
     }
 
-    // Forward client request to remote server
-    char request[BUFFER_SIZE*2];
-    snprintf(request, sizeof(request), "%s %s %s\r\n", method, path, protocol);
-
-    // Find end of request line
-    char *headers_start = strstr(buffer, "\r\n");
-    if (headers_start) {
-        strncat(request, headers_start + 2, sizeof(request) - strlen(request) - 1);
-    }
-    send(remote_socket, request, strlen(request), 0);
-
-    // Only set up caching for non-CONNECT requests
-    char *response = NULL;
-    size_t response_capacity = BUFFER_SIZE * 2;  // Start with 16KB
-    int offset = 0;
-    bool headers_complete = false;
-    bool is_success = false;
-
-    if (should_cache) {
-        response = malloc(response_capacity);
-        if (!response) {
-            close(client_socket);
-            close(remote_socket);
-            return NULL;
+    // A cacheable miss owned by another cluster member is fetched through that
+    // member, unless it already came from one
+    char peer_host[256];
+    int peer_port = 0;
+    bool via_peer = should_cache && cluster_enabled() &&
+                    !request_find_header(&req, "x-proxy-peer") &&
+                    cluster_owner(cache_key, peer_host, sizeof(peer_host), &peer_port);
+    int remote_socket = -1;
+    if (via_peer) {
+        remote_socket = connect_to_host(peer_host, peer_port, d);
+        if (remote_socket < 0) {
+            // Rebalance and fall back to the origin
+            cluster_peer_failed(peer_host, peer_port);
+            via_peer = false;
         }
     }
-
-    // Set socket timeout to make reads faster
-    struct timeval tv;
-    tv.tv_sec = 2;  // 2 seconds timeout
-    tv.tv_usec = 0;
-    setsockopt(remote_socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
-
-    // Use select() for non-blocking reads
-    fd_set readfds;
-    struct timeval timeout;
-    int ready;
-
-    while (1) {
-        FD_ZERO(&readfds);
-        FD_SET(remote_socket, &readfds);
-        
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
-        
-        ready = select(remote_socket + 1, &readfds, NULL, NULL, &timeout);
-        if (ready <= 0) break;  // Timeout or error
-        
-        bytes_received = recv(remote_socket, buffer, BUFFER_SIZE, 0);
-        if (bytes_received <= 0) break;
-
-        // Forward to client immediately
-        send(client_socket, buffer, bytes_received, 0);
-        
-        // Process for caching if needed
-        if (should_cache && response) {
-            // Check if we need to grow the buffer
-            while (offset + bytes_received >= response_capacity) {
-                size_t new_capacity = response_capacity * 2;
-                char *new_response = realloc(response, new_capacity);
-                if (!new_response) {
-                    printf("[CACHE DEBUG] Failed to grow buffer to %zu bytes\n", new_capacity);
-                    free(response);
-                    response = NULL;
-                    goto cleanup;
-                }
-                response = new_response;
-                response_capacity = new_capacity;
-                printf("[CACHE DEBUG] Grew buffer to %zu bytes\n", response_capacity);
-            }
-            
-            // Copy new data
-            memcpy(response + offset, buffer, bytes_received);
-            offset += bytes_received;
-            response[offset] = '\0';
-            
-            // Check headers on first chunk
-            if (!headers_complete && strstr(response, "\r\n\r\n")) {
-                headers_complete = true;
-                if (strstr(response, "HTTP/1.1 200") || strstr(response, "HTTP/1.0 200")) {
-                    is_success = true;
-                    printf("[CACHE DEBUG] Got successful response, continuing to cache\n");
-                } else {
-                    printf("[CACHE DEBUG] Not a 200 response, stopping cache\n");
-                    free(response);
-                    response = NULL;
-                    goto cleanup;
-                }
-            }
-        }
+    if (!via_peer) remote_socket = connect_to_host(host, port, d);
+    if (remote_socket < 0) {
+        admission_release_upstream();
+        return;
     }
 
-    // Cache if we have a complete successful response
-    if (should_cache && response && offset > 0 && is_success) {
-        printf("[CACHE DEBUG] Caching response of size: %d bytes\n", offset);
-        add_to_cache(cache_key, response);
+    // Forward client request to remote server in one sendmsg: rewritten request
+    // line, the client's headers straight from the receive buffer (minus
+    // hop-by-hop ones), Via/X-Forwarded-For, then the body streamed from the client
+    char request_line[sizeof(method) + sizeof(url) + sizeof(protocol) + 64];
+    int request_line_len;
+    if (via_peer) {
+        // Absolute-form so the owner builds the same cache key; the peer
+        // marker goes out right behind the request line. The owner keeps the copy.
+        printf("[CLUSTER] %s owned by %s:%d\n", cache_key, peer_host, peer_port);
+        request_line_len = snprintf(request_line, sizeof(request_line), "%s %s%s %s\r\n" PEER_HEADER ": 1\r\n",
+                                    method, strncmp(url, "http://", 7) == 0 ? "" : "http://", url, protocol);
+        should_cache = false;
+    } else {
+        request_line_len = snprintf(request_line, sizeof(request_line), "%s %s %s\r\n", method, path, protocol);
     }
 
-cleanup:
-    if (response) free(response);
-    close(remote_socket);
+    relay_from_origin(client_socket, remote_socket, &req, request_line, request_line_len,
+                      should_cache, cache_key, url, d);
+    admission_release_upstream();
+}
+
+// Handle HTTP/HTTPS requests
+void *handle_client(void *arg) {
+    ClientConn *conn = arg;
+    int client_socket = conn->fd;
+    bool hits_only = conn->hits_only;
+    free(conn);
+
+    // Per-connection buffers come from the pool rather than the thread stack
+    char *buffer = pool_alloc(REQUEST_BUFFER_SIZE);
+    char *cache_key = pool_alloc(CACHE_KEY_SIZE);
+    Deadline deadline;
+    deadline_init(&deadline);
+    if (buffer && cache_key) {
+        serve_client(client_socket, hits_only, buffer, cache_key, &deadline);
+    }
+    deadline_disarm(&deadline);
     close(client_socket);
+    pool_free(buffer);
+    pool_free(cache_key);
+    admission_leave_connection();
     return NULL;
 }
 
 // Server thread function
 void* server_thread_func(void* arg) {
+    // A client that goes away mid-send must not take the process down
+    signal(SIGPIPE, SIG_IGN);
+    admission_init();
+    timer_init();
+    compress_init();
+    prefetch_init();
+
+    // Several instances can share a machine when each gets its own port
+    int port = config_long("PROXY_PORT", PORT);
+    cluster_init(port);
+
     int server_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (server_fd < 0) {
         perror("[-] Unable to create socket");
         return NULL;
     }
 
+    // Restarting must not wait for the old listener's TIME_WAIT connections
+    int reuse = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
     struct sockaddr_in server_addr;
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(PORT);
+    server_addr.sin_port = htons(port);
 
     if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
         perror("[-] Bind failed");
@@ -406,20 +607,45 @@ void* server_thread_func(void* arg) {
         return NULL;
     }
 
-    char *msg = strdup("[+] Proxy server running on port 8080");
+    // Connection threads keep their large buffers in the pool, so a small stack will do
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
+
+    char running[64];
+    snprintf(running, sizeof(running), "[+] Proxy server running on port %d", port);
+    char *msg = strdup(running);
     g_idle_add(log_message_idle, msg);
 
     while (1) {
-        int *client_fd = (int *)malloc(sizeof(int));
-        *client_fd = accept(server_fd, NULL, NULL);
-        if (*client_fd < 0) {
+        int fd = accept(server_fd, NULL, NULL);
+        if (fd < 0) {
             perror("[-] Accept failed");
-            free(client_fd);
             continue;
         }
 
+        // Decide at accept time, before any per-connection resources exist
+        Admission admit = admission_enter_connection();
+        if (admit == ADMIT_REJECT) {
+            admission_send_503(fd);
+            close(fd);
+            continue;
+        }
+
+        ClientConn *conn = malloc(sizeof(ClientConn));
         pthread_t thread;
-        pthread_create(&thread, NULL, handle_client, client_fd);
+        if (conn) {
+            conn->fd = fd;
+            conn->hits_only = (admit == ADMIT_HITS_ONLY);
+        }
+        if (!conn || pthread_create(&thread, &attr, handle_client, conn) != 0) {
+            free(conn);
+            admission_leave_connection();
+            admission_count_spawn_failure();
+            admission_send_503(fd);
+            close(fd);
+            continue;
+        }
         pthread_detach(thread);
     }
 
@@ -1,9 +1,12 @@
 #ifndef PROXY_H
 #define PROXY_H
 #include <stddef.h>
+#include "timer.h"
 
 void* server_thread_func(void* arg);
 void* handle_client(void* arg);
-void build_cache_key(const char *method, const char *url, const char *body, char *key, size_t keysize);
+int build_cache_key(const char *method, const char *url, const char *body, char *key, size_t keysize);
+int is_blocked(const char *host);
+int connect_to_host(const char *host, int port, Deadline *d);
 
 #endif
@@ -0,0 +1,467 @@
+#include "request.h"
+#include "scan.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/types.h>
+
+#define BUFFER_SIZE 8192
+
+enum {
+    CHUNK_SIZE,         // hex digits of the chunk size
+    CHUNK_EXT,          // chunk extensions and CR up to the LF
+    CHUNK_DATA,         // chunk payload
+    CHUNK_DATA_END,     // CRLF after the payload
+    CHUNK_TRAILER,      // start of a trailer line, or the final blank line
+    CHUNK_TRAILER_LINE, // rest of a trailer line
+    CHUNK_DONE,
+    CHUNK_ERROR
+};
+
+int send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n <= 0) return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+void request_init(HttpRequest *req, char *buf, size_t cap) {
+    memset(req, 0, sizeof(*req));
+    req->buf = buf;
+    req->cap = cap;
+    req->body_kind = BODY_NONE;
+    chunk_init(&req->chunk);
+}
+
+static Slice make_slice(size_t start, size_t end) {
+    Slice s = { start, end - start };
+    return s;
+}
+
+// str must be lower case
+static int slice_ieq(const HttpRequest *req, Slice s, const char *str) {
+    return scan_name_eq(req->buf + s.off, s.len, str);
+}
+
+// Split "METHOD TARGET VERSION" into three slices
+static int parse_request_line(HttpRequest *req, size_t start, size_t end) {
+    const char *b = req->buf;
+    size_t p = start;
+
+    size_t m_end = p;
+    while (m_end < end && b[m_end] != ' ') m_end++;
+    if (m_end == p || m_end == end) return REQ_ERROR;
+    req->method = make_slice(p, m_end);
+
+    p = m_end + 1;
+    size_t t_end = p;
+    while (t_end < end && b[t_end] != ' ') t_end++;
+    if (t_end == p || t_end == end) return REQ_ERROR;
+    req->target = make_slice(p, t_end);
+
+    p = t_end + 1;
+    if (end - p < 8 || strncmp(b + p, "HTTP/", 5) != 0) return REQ_ERROR;
+    req->version = make_slice(p, end);
+    return REQ_INCOMPLETE;
+}
+
+static int parse_header_line(HttpRequest *req, size_t start, size_t end, size_t next) {
+    const char *b = req->buf;
+
+    // Obsolete line folding is not supported
+    if (b[start] == ' ' || b[start] == '\t') return REQ_ERROR;
+    if (req->num_headers == MAX_HEADERS) return REQ_TOO_LARGE;
+
+    size_t colon = start;
+    while (colon < end && b[colon] != ':') colon++;
+    if (colon == start || colon == end) return REQ_ERROR;
+
+    size_t v_start = colon + 1, v_end = end;
+    while (v_start < v_end && (b[v_start] == ' ' || b[v_start] == '\t')) v_start++;
+    while (v_end > v_start && (b[v_end - 1] == ' ' || b[v_end - 1] == '\t')) v_end--;
+
+    Header *h = &req->headers[req->num_headers++];
+    h->name = make_slice(start, colon);
+    h->value = make_slice(v_start, v_end);
+    h->line = make_slice(start, next);
+    return REQ_INCOMPLETE;
+}
+
+// Check one Transfer-Encoding line: its codings are a comma-separated list
+// whose last entry must be exactly chunked, with nothing after it
+static int te_line_ends_chunked(const HttpRequest *req, const Header *h) {
+    const char *v = req->buf + h->value.off;
+    size_t len = h->value.len, p = 0;
+    int chunked = 0;
+    while (p < len) {
+        while (p < len && (v[p] == ' ' || v[p] == '\t' || v[p] == ',')) p++;
+        size_t start = p;
+        while (p < len && v[p] != ',') p++;
+        size_t end = p;
+        while (end > start && (v[end - 1] == ' ' || v[end - 1] == '\t')) end--;
+        if (end == start) continue;
+
+        if (chunked) return 0;      // a coding after chunked, or chunked twice
+        chunked = end - start == 7 && strncasecmp(v + start, "chunked", 7) == 0;
+    }
+    return chunked;
+}
+
+// Decide how the body is framed once all headers are known
+static int finish_headers(HttpRequest *req) {
+    if (request_find_header(req, "transfer-encoding")) {
+        // With both headers, the origin might frame the body by Content-Length
+        // while we frame it by chunks: the request smuggling setup. RFC 9112
+        // section 6.1 lets a proxy reject such a message, so we do.
+        if (request_find_header(req, "content-length")) return REQ_ERROR;
+
+        // Every line is forwarded, so each must end in chunked or the origin
+        // could see another final coding. Since chunked may only be applied
+        // once, that leaves room for a single line.
+        int lines = 0;
+        for (int i = 0; i < req->num_headers; i++) {
+            const Header *h = &req->headers[i];
+            if (!slice_ieq(req, h->name, "transfer-encoding")) continue;
+            if (!te_line_ends_chunked(req, h) || ++lines > 1) return REQ_ERROR;
+        }
+        req->body_kind = BODY_CHUNKED;
+        return REQ_COMPLETE;
+    }
+
+    for (int i = 0; i < req->num_headers; i++) {
+        const Header *h = &req->headers[i];
+        if (!slice_ieq(req, h->name, "content-length")) continue;
+        if (h->value.len == 0 || h->value.len > 18) return REQ_ERROR;
+
+        unsigned long long n = 0;
+        for (size_t j = 0; j < h->value.len; j++) {
+            char c = req->buf[h->value.off + j];
+            if (c < '0' || c > '9') return REQ_ERROR;
+            n = n * 10 + (c - '0');
+        }
+        if (req->body_kind == BODY_LENGTH && n != req->content_length) return REQ_ERROR;
+        req->body_kind = BODY_LENGTH;
+        req->content_length = req->body_remaining = n;
+    }
+    return REQ_COMPLETE;
+}
+
+// Parse whatever complete lines have arrived since the last call
+int request_parse(HttpRequest *req) {
+    if (req->headers_done) return REQ_COMPLETE;
+
+    while (1) {
+        char *lf = memchr(req->buf + req->scan, '\n', req->len - req->scan);
+        if (!lf) {
+            req->scan = req->len;
+            return req->len == req->cap ? REQ_TOO_LARGE : REQ_INCOMPLETE;
+        }
+
+        size_t start = req->line_start;
+        size_t next = lf - req->buf + 1;
+        size_t end = next - 1;
+        if (end > start && req->buf[end - 1] == '\r') end--;
+        req->line_start = req->scan = next;
+
+        int rc;
+        if (req->method.len == 0) {
+            // Tolerate stray blank lines before the request line
+            if (end == start) continue;
+            rc = parse_request_line(req, start, end);
+            req->headers_start = next;
+        } else if (end == start) {
+            req->header_end = req->body_pos = next;
+            req->headers_done = 1;
+            return finish_headers(req);
+        } else {
+            rc = parse_header_line(req, start, end, next);
+        }
+        if (rc != REQ_INCOMPLETE) return rc;
+    }
+}
+
+// Receive until the header block is complete; body bytes may follow it in buf
+int request_read_headers(HttpRequest *req, int fd) {
+    int rc = request_parse(req);
+    while (rc == REQ_INCOMPLETE) {
+        ssize_t n = recv(fd, req->buf + req->len, req->cap - req->len, 0);
+        if (n <= 0) return REQ_CLOSED;
+        req->len += n;
+        rc = request_parse(req);
+    }
+    return rc;
+}
+
+int request_slice_copy(const HttpRequest *req, Slice s, char *dst, size_t dstsize) {
+    if (s.len >= dstsize) return -1;
+    memcpy(dst, req->buf + s.off, s.len);
+    dst[s.len] = '\0';
+    return 0;
+}
+
+// Look up a header by its lower-case name
+const Header* request_find_header(const HttpRequest *req, const char *name) {
+    for (int i = 0; i < req->num_headers; i++) {
+        if (slice_ieq(req, req->headers[i].name, name)) return &req->headers[i];
+    }
+    return NULL;
+}
+
+// Body bytes that arrived together with the headers
+size_t request_body_buffered(const HttpRequest *req) {
+    return req->len - req->header_end;
+}
+
+// True when the whole body is already in buf (no body counts as complete)
+int request_body_in_buffer(const HttpRequest *req) {
+    switch (req->body_kind) {
+    case BODY_NONE:
+        return 1;
+    case BODY_LENGTH:
+        return request_body_buffered(req) >= req->content_length;
+    case BODY_CHUNKED:
+    default:
+        return 0;
+    }
+}
+
+static int body_done(const HttpRequest *req) {
+    switch (req->body_kind) {
+    case BODY_LENGTH:
+        return req->body_remaining == 0;
+    case BODY_CHUNKED:
+        return chunk_done(&req->chunk);
+    case BODY_NONE:
+    default:
+        return 1;
+    }
+}
+
+// How many of the len bytes at data belong to the body; -1 on bad framing
+static long body_take(HttpRequest *req, const char *data, size_t len) {
+    if (req->body_kind == BODY_LENGTH) {
+        size_t n = len < req->body_remaining ? len : (size_t)req->body_remaining;
+        req->body_remaining -= n;
+        return n;
+    }
+    if (req->body_kind == BODY_CHUNKED) {
+        size_t n = chunk_feed(&req->chunk, data, len);
+        return chunk_failed(&req->chunk) ? -1 : (long)n;
+    }
+    return 0;
+}
+
+// Stream the rest of the request body from the client to the remote side in
+// bounded pieces, touching progress (if any) as bytes arrive. Returns the
+// number of body bytes forwarded, or -1 on error.
+long long request_relay_body(HttpRequest *req, int client_fd, int remote_fd, Deadline *progress) {
+    char chunk[BUFFER_SIZE];
+    const char *data = req->buf + req->body_pos;
+    size_t avail = req->len - req->body_pos;
+    long long forwarded = 0;
+
+    while (!body_done(req)) {
+        if (avail == 0) {
+            ssize_t r = recv(client_fd, chunk, sizeof(chunk), 0);
+            if (r <= 0) return -1;
+            if (progress) deadline_touch(progress);
+            data = chunk;
+            avail = r;
+        }
+        long n = body_take(req, data, avail);
+        if (n < 0) return -1;
+        if (n > 0 && send_all(remote_fd, data, n) < 0) return -1;
+        if (data == req->buf + req->body_pos) req->body_pos += n;
+        forwarded += n;
+        data += n;
+        avail -= n;
+    }
+    return forwarded;
+}
+
+// Send a whole iovec array, resuming after partial writes
+int send_iov_all(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// Hop-by-hop headers, plus any header the client listed in Connection. The
+// cluster's peer marker is hop-by-hop too: it never reaches an origin.
+static int is_hop_by_hop(const HttpRequest *req, const Header *h, const Header *connection) {
+    static const char *hop_headers[] = {
+        "connection", "proxy-connection", "keep-alive", "te", "trailer",
+        "upgrade", "proxy-authorization", "proxy-authenticate", "x-proxy-peer"
+    };
+    for (size_t i = 0; i < sizeof(hop_headers) / sizeof(hop_headers[0]); i++) {
+        if (slice_ieq(req, h->name, hop_headers[i])) return 1;
+    }
+    if (!connection) return 0;
+
+    const char *v = req->buf + connection->value.off;
+    size_t len = connection->value.len, p = 0;
+    while (p < len) {
+        while (p < len && (v[p] == ' ' || v[p] == '\t' || v[p] == ',')) p++;
+        size_t start = p;
+        while (p < len && v[p] != ',' && v[p] != ' ' && v[p] != '\t') p++;
+        if (p > start && p - start == h->name.len &&
+            strncasecmp(v + start, req->buf + h->name.off, p - start) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Forward the request head with a single sendmsg: the caller's request line,
+// the client's header lines minus hop-by-hop ones (pointing straight into
+// buf), a small block of added headers, and whatever body bytes arrived with
+// the headers. The rest of the body follows with request_relay_body.
+int request_forward(HttpRequest *req, int fd, const char *request_line, size_t line_len, const char *client_ip) {
+    struct iovec iov[MAX_HEADERS + 4];
+    int n = 0;
+    iov[n].iov_base = (void *)request_line;
+    iov[n++].iov_len = line_len;
+
+    // Runs of kept header lines are contiguous in buf and share one iovec
+    const Header *connection = request_find_header(req, "connection");
+    for (int i = 0; i < req->num_headers; i++) {
+        const Header *h = &req->headers[i];
+        if (is_hop_by_hop(req, h, connection)) continue;
+        char *line = req->buf + h->line.off;
+        if (n > 1 && (char *)iov[n - 1].iov_base + iov[n - 1].iov_len == line) {
+            iov[n - 1].iov_len += h->line.len;
+        } else {
+            iov[n].iov_base = line;
+            iov[n++].iov_len = h->line.len;
+        }
+    }
+
+    // Existing Via and X-Forwarded-For lines are kept; a repeated field is
+    // equivalent to appending to the comma-separated list
+    char added[256];
+    const char *version = req->buf + req->version.off + 5;
+    int added_len = snprintf(added, sizeof(added),
+                             "Via: %.*s proxy\r\nX-Forwarded-For: %s\r\nConnection: close\r\n\r\n",
+                             (int)req->version.len - 5, version, client_ip ? client_ip : "unknown");
+    if (added_len < 0 || (size_t)added_len >= sizeof(added)) return -1;
+    iov[n].iov_base = added;
+    iov[n++].iov_len = added_len;
+
+    size_t buffered = req->len - req->body_pos;
+    if (buffered > 0) {
+        long body = body_take(req, req->buf + req->body_pos, buffered);
+        if (body < 0) return -1;
+        if (body > 0) {
+            iov[n].iov_base = req->buf + req->body_pos;
+            iov[n++].iov_len = body;
+            req->body_pos += body;
+        }
+    }
+    return send_iov_all(fd, iov, n);
+}
+
+void chunk_init(ChunkDecoder *d) {
+    d->state = CHUNK_SIZE;
+    d->remaining = 0;
+    d->digits = 0;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Consume framing from data; returns how many bytes belong to the body,
+// which is less than len only once the terminating chunk has been seen
+size_t chunk_feed(ChunkDecoder *d, const char *data, size_t len) {
+    size_t i = 0;
+    while (i < len && d->state != CHUNK_DONE && d->state != CHUNK_ERROR) {
+        char c = data[i];
+        switch (d->state) {
+        case CHUNK_SIZE: {
+            int v = hex_value(c);
+            if (v >= 0) {
+                if (++d->digits > 15) {
+                    d->state = CHUNK_ERROR;
+                    return i;
+                }
+                d->remaining = d->remaining * 16 + v;
+                i++;
+                break;
+            }
+            if (d->digits == 0) {
+                d->state = CHUNK_ERROR;
+                return i;
+            }
+            d->state = CHUNK_EXT;
+            break;
+        }
+        case CHUNK_EXT:
+            i++;
+            if (c == '\n') {
+                d->digits = 0;
+                d->state = d->remaining ? CHUNK_DATA : CHUNK_TRAILER;
+            }
+            break;
+        case CHUNK_DATA: {
+            size_t n = len - i;
+            if (n > d->remaining) n = d->remaining;
+            i += n;
+            d->remaining -= n;
+            if (d->remaining == 0) d->state = CHUNK_DATA_END;
+            break;
+        }
+        case CHUNK_DATA_END:
+            i++;
+            if (c == '\n') d->state = CHUNK_SIZE;
+            else if (c != '\r') d->state = CHUNK_ERROR;
+            break;
+        case CHUNK_TRAILER:
+            i++;
+            if (c == '\n') d->state = CHUNK_DONE;
+            else if (c != '\r') d->state = CHUNK_TRAILER_LINE;
+            break;
+        case CHUNK_TRAILER_LINE:
+            i++;
+            if (c == '\n') d->state = CHUNK_TRAILER;
+            break;
+        }
+    }
+    return i;
+}
+
+int chunk_done(const ChunkDecoder *d) {
+    return d->state == CHUNK_DONE;
+}
+
+int chunk_failed(const ChunkDecoder *d) {
+    return d->state == CHUNK_ERROR;
+}
@@ -0,0 +1,84 @@
+#ifndef REQUEST_H
+#define REQUEST_H
+
+#include "timer.h"
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define REQUEST_BUFFER_SIZE 32768
+#define MAX_HEADERS 64
+
+// A view into the receive buffer; nothing is copied out while parsing
+typedef struct {
+    size_t off;
+    size_t len;
+} Slice;
+
+typedef struct {
+    Slice name;
+    Slice value;
+    Slice line;             // the whole line including its terminator
+} Header;
+
+typedef enum {
+    BODY_NONE,
+    BODY_LENGTH,
+    BODY_CHUNKED
+} BodyKind;
+
+// Incremental chunked transfer-coding decoder; it only tracks framing,
+// the bytes themselves are passed through unchanged
+typedef struct {
+    int state;
+    unsigned long long remaining;
+    int digits;
+} ChunkDecoder;
+
+typedef struct {
+    char *buf;
+    size_t cap;
+    size_t len;             // bytes received into buf so far
+    size_t line_start;      // start of the line currently being parsed
+    size_t scan;            // where the search for the next LF resumes
+    int headers_done;
+
+    Slice method, target, version;
+    Header headers[MAX_HEADERS];
+    int num_headers;
+    size_t headers_start;   // offset of the first header line
+    size_t header_end;      // offset just past the blank line
+
+    BodyKind body_kind;
+    unsigned long long content_length;
+    unsigned long long body_remaining;
+    size_t body_pos;        // next body byte in buf not yet forwarded
+    ChunkDecoder chunk;
+} HttpRequest;
+
+enum {
+    REQ_INCOMPLETE = 0,
+    REQ_COMPLETE = 1,
+    REQ_ERROR = -1,
+    REQ_TOO_LARGE = -2,
+    REQ_CLOSED = -3
+};
+
+void request_init(HttpRequest *req, char *buf, size_t cap);
+int request_parse(HttpRequest *req);
+int request_read_headers(HttpRequest *req, int fd);
+int request_slice_copy(const HttpRequest *req, Slice s, char *dst, size_t dstsize);
+const Header* request_find_header(const HttpRequest *req, const char *name);
+size_t request_body_buffered(const HttpRequest *req);
+int request_body_in_buffer(const HttpRequest *req);
+int request_forward(HttpRequest *req, int fd, const char *request_line, size_t line_len, const char *client_ip);
+long long request_relay_body(HttpRequest *req, int client_fd, int remote_fd, Deadline *progress);
+
+void chunk_init(ChunkDecoder *d);
+size_t chunk_feed(ChunkDecoder *d, const char *data, size_t len);
+int chunk_done(const ChunkDecoder *d);
+int chunk_failed(const ChunkDecoder *d);
+
+int send_all(int fd, const char *data, size_t len);
+int send_iov_all(int fd, struct iovec *iov, int iovcnt);
+
+#endif
@@ -0,0 +1,150 @@
+#include "scan.h"
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+typedef long (*header_end_fn)(const char *buf, size_t len, size_t from);
+typedef int (*name_eq_fn)(const char *name, const char *want, size_t len);
+
+static header_end_fn header_end_impl;
+static name_eq_fn name_eq_impl;
+static int active_impl;
+static pthread_once_t scan_once = PTHREAD_ONCE_INIT;
+
+static inline char to_lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? c + 32 : c;
+}
+
+static long header_end_scalar(const char *buf, size_t len, size_t from) {
+    if (len < 4) return -1;
+    for (size_t i = from; i + 3 < len; i++) {
+        // Jump between CR candidates with memchr rather than testing every byte
+        const char *cr = memchr(buf + i, '\r', len - 3 - i);
+        if (!cr) return -1;
+        i = cr - buf;
+        if (buf[i + 1] == '\n' && buf[i + 2] == '\r' && buf[i + 3] == '\n') return i;
+    }
+    return -1;
+}
+
+// want is lower case and the same length as name
+static int name_eq_scalar(const char *name, const char *want, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (to_lower(name[i]) != want[i]) return 0;
+    }
+    return 1;
+}
+
+#ifdef SCAN_X86
+// Candidate positions are where bytes i and i+2 are CR and i+1 and i+3 are LF
+static long header_end_sse2(const char *buf, size_t len, size_t from) {
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    size_t i = from;
+    while (i + 3 + 16 <= len) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(buf + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(buf + i + 1));
+        __m128i c = _mm_loadu_si128((const __m128i *)(buf + i + 2));
+        __m128i d = _mm_loadu_si128((const __m128i *)(buf + i + 3));
+        __m128i m = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(a, cr), _mm_cmpeq_epi8(b, lf)),
+                                  _mm_and_si128(_mm_cmpeq_epi8(c, cr), _mm_cmpeq_epi8(d, lf)));
+        int mask = _mm_movemask_epi8(m);
+        if (mask) return i + __builtin_ctz(mask);
+        i += 16;
+    }
+    return header_end_scalar(buf, len, i);
+}
+
+static int name_eq_sse2(const char *name, const char *want, size_t len) {
+    const __m128i upper_lo = _mm_set1_epi8('A' - 1);
+    const __m128i upper_hi = _mm_set1_epi8('Z' + 1);
+    const __m128i case_bit = _mm_set1_epi8(0x20);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(name + i));
+        __m128i w = _mm_loadu_si128((const __m128i *)(want + i));
+        __m128i is_upper = _mm_and_si128(_mm_cmpgt_epi8(v, upper_lo), _mm_cmpgt_epi8(upper_hi, v));
+        v = _mm_add_epi8(v, _mm_and_si128(is_upper, case_bit));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, w)) != 0xFFFF) return 0;
+    }
+    return name_eq_scalar(name + i, want + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static long header_end_avx2(const char *buf, size_t len, size_t from) {
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    size_t i = from;
+    while (i + 3 + 32 <= len) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(buf + i + 1));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(buf + i + 2));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(buf + i + 3));
+        __m256i m = _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(a, cr), _mm256_cmpeq_epi8(b, lf)),
+                                     _mm256_and_si256(_mm256_cmpeq_epi8(c, cr), _mm256_cmpeq_epi8(d, lf)));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(m);
+        if (mask) return i + __builtin_ctz(mask);
+        i += 32;
+    }
+    return header_end_sse2(buf, len, i);
+}
+#endif
+
+static void apply_impl(int impl) {
+    header_end_impl = header_end_scalar;
+    name_eq_impl = name_eq_scalar;
+    active_impl = SCAN_SCALAR;
+#ifdef SCAN_X86
+    if (impl >= SCAN_SSE2 && __builtin_cpu_supports("sse2")) {
+        header_end_impl = header_end_sse2;
+        name_eq_impl = name_eq_sse2;
+        active_impl = SCAN_SSE2;
+    }
+    if (impl >= SCAN_AVX2 && __builtin_cpu_supports("avx2")) {
+        header_end_impl = header_end_avx2;
+        active_impl = SCAN_AVX2;
+    }
+#endif
+}
+
+static void scan_init(void) {
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+#endif
+    apply_impl(SCAN_AVX2);
+}
+
+// Force an implementation; falls back to the best supported one below it.
+// Not thread-safe against concurrent scans, meant for benchmarks.
+int scan_select(int impl) {
+    pthread_once(&scan_once, scan_init);
+    apply_impl(impl);
+    return active_impl;
+}
+
+const char* scan_impl_name(void) {
+    pthread_once(&scan_once, scan_init);
+    switch (active_impl) {
+    case SCAN_AVX2: return "avx2";
+    case SCAN_SSE2: return "sse2";
+    default: return "scalar";
+    }
+}
+
+// Offset of the first "\r\n\r\n" at or after from, or -1. Callers that
+// accumulate data pass the previous length minus 3 so nothing is rescanned.
+long scan_header_end(const char *buf, size_t len, size_t from) {
+    pthread_once(&scan_once, scan_init);
+    return header_end_impl(buf, len, from);
+}
+
+// Case-insensitive match of a header name against a lower-case literal
+int scan_name_eq(const char *name, size_t len, const char *want) {
+    pthread_once(&scan_once, scan_init);
+    if (strlen(want) != len) return 0;
+    return name_eq_impl(name, want, len);
+}
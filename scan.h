@@ -0,0 +1,19 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+
+// Byte scanners for HTTP framing. The fastest implementation the CPU
+// supports is picked at runtime; scan_select can force one for benchmarks.
+enum {
+    SCAN_SCALAR,
+    SCAN_SSE2,
+    SCAN_AVX2
+};
+
+long scan_header_end(const char *buf, size_t len, size_t from);
+int scan_name_eq(const char *name, size_t len, const char *want);
+int scan_select(int impl);
+const char* scan_impl_name(void);
+
+#endif
@@ -0,0 +1,128 @@
+// Request parser checks: how each request is framed, and which requests must
+// be refused. Run with make test; prints one line per failure and exits 1 if
+// there were any.
+#include "request.h"
+#include <stdio.h>
+#include <string.h>
+
+typedef struct {
+    const char *name;
+    const char *request;
+    int result;                 // what request_parse must return
+    BodyKind body_kind;         // checked when result is REQ_COMPLETE
+    unsigned long long content_length;
+} ParseCase;
+
+static const ParseCase cases[] = {
+    { "get without body",
+      "GET http://www.example.com/ HTTP/1.1\r\n"
+      "Host: www.example.com\r\n\r\n",
+      REQ_COMPLETE, BODY_NONE, 0 },
+    { "content-length body",
+      "POST http://api.example.com/v2/login HTTP/1.1\r\n"
+      "Host: api.example.com\r\n"
+      "Content-Length: 4\r\n\r\n"
+      "abcd",
+      REQ_COMPLETE, BODY_LENGTH, 4 },
+    { "repeated equal content-length",
+      "POST http://api.example.com/v2/login HTTP/1.1\r\n"
+      "Host: api.example.com\r\n"
+      "Content-Length: 4\r\n"
+      "Content-Length: 4\r\n\r\n"
+      "abcd",
+      REQ_COMPLETE, BODY_LENGTH, 4 },
+    { "chunked body",
+      "POST http://api.example.com/v2/login HTTP/1.1\r\n"
+      "Host: api.example.com\r\n"
+      "Transfer-Encoding: chunked\r\n\r\n"
+      "0\r\n\r\n",
+      REQ_COMPLETE, BODY_CHUNKED, 0 },
+    { "chunked after another coding",
+      "POST http://api.example.com/v2/login HTTP/1.1\r\n"
+      "Host: api.example.com\r\n"
+      "Transfer-Encoding: gzip, Chunked\r\n\r\n"
+      "0\r\n\r\n",
+      REQ_COMPLETE, BODY_CHUNKED, 0 },
+
+    // Transfer-Encoding the origin could frame differently
+    { "chunked suffix of another token",
+      "POST http://api.example.com/v2/login HTTP/1.1\r\n"
+      "Host: api.example.com\r\n"
+      "Transfer-Encoding: xchunked\r\n\r\n"
+      "0\r\n\r\n",
+      REQ_ERROR, BODY_NONE, 0 },
+    { "coding after chunked",
+      "POST http://api.example.com/v2/login HTTP/1.1\r\n"
+      "Host: api.example.com\r\n"
+      "Transfer-Encoding: chunked, gzip\r\n\r\n"
+      "0\r\n\r\n",
+      REQ_ERROR, BODY_NONE, 0 },
+    { "chunked twice",
+      "POST http://api.example.com/v2/login HTTP/1.1\r\n"
+      "Host: api.example.com\r\n"
+      "Transfer-Encoding: chunked, chunked\r\n\r\n"
+      "0\r\n\r\n",
+      REQ_ERROR, BODY_NONE, 0 },
+    { "second te line ends in another coding",
+      "POST http://api.example.com/v2/login HTTP/1.1\r\n"
+      "Host: api.example.com\r\n"
+      "Transfer-Encoding: chunked\r\n"
+      "Transfer-Encoding: gzip\r\n\r\n"
+      "0\r\n\r\n",
+      REQ_ERROR, BODY_NONE, 0 },
+    { "first te line ends in another coding",
+      "POST http://api.example.com/v2/login HTTP/1.1\r\n"
+      "Host: api.example.com\r\n"
+      "Transfer-Encoding: gzip\r\n"
+      "Transfer-Encoding: chunked\r\n\r\n"
+      "0\r\n\r\n",
+      REQ_ERROR, BODY_NONE, 0 },
+
+    // Transfer-Encoding and Content-Length together (request smuggling)
+    { "te then cl",
+      "POST http://api.example.com/v2/login HTTP/1.1\r\n"
+      "Host: api.example.com\r\n"
+      "Transfer-Encoding: chunked\r\n"
+      "Content-Length: 4\r\n\r\n"
+      "0\r\n\r\n",
+      REQ_ERROR, BODY_NONE, 0 },
+    { "cl then te",
+      "POST http://api.example.com/v2/login HTTP/1.1\r\n"
+      "Host: api.example.com\r\n"
+      "Content-Length: 4\r\n"
+      "Transfer-Encoding: chunked\r\n\r\n"
+      "0\r\n\r\n",
+      REQ_ERROR, BODY_NONE, 0 },
+    { "conflicting content-length",
+      "POST http://api.example.com/v2/login HTTP/1.1\r\n"
+      "Host: api.example.com\r\n"
+      "Content-Length: 4\r\n"
+      "Content-Length: 5\r\n\r\n"
+      "abcd",
+      REQ_ERROR, BODY_NONE, 0 },
+};
+
+int main(void) {
+    int failures = 0;
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        const ParseCase *c = &cases[i];
+        // The parser only reads the buffer, so it can point at the literal directly
+        size_t len = strlen(c->request);
+        HttpRequest req;
+        request_init(&req, (char *)c->request, len);
+        req.len = len;
+
+        int rc = request_parse(&req);
+        if (rc != c->result) {
+            printf("FAIL %s: result %d, expected %d\n", c->name, rc, c->result);
+            failures++;
+        } else if (rc == REQ_COMPLETE &&
+                   (req.body_kind != c->body_kind || req.content_length != c->content_length)) {
+            printf("FAIL %s: body kind %d length %llu, expected %d length %llu\n", c->name,
+                   req.body_kind, req.content_length, c->body_kind, c->content_length);
+            failures++;
+        }
+    }
+    printf("request_test: %zu cases, %d failed\n", sizeof(cases) / sizeof(cases[0]), failures);
+    return failures ? 1 : 0;
+}
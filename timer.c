@@ -0,0 +1,258 @@
+#include "timer.h"
+#include "config.h"
+#include "gui.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#define TIMER_TICK_MS 10
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_SPAN (1ULL << (WHEEL_BITS * WHEEL_LEVELS))
+#define REPORT_MS 1000
+
+// Each slot is a circular list with a sentinel head
+static Timer wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static uint64_t next_tick = 0;      // the next tick to process
+static uint64_t start_ms;
+static pthread_mutex_t wheel_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t wheel_once = PTHREAD_ONCE_INIT;
+
+static long timeouts_ms[TIMEOUT_KINDS];
+static unsigned long fired_counts[TIMEOUT_KINDS];     // only touched on the wheel thread
+static unsigned long reported_total = 0;
+static Timer report_timer;
+static const char *kind_names[TIMEOUT_KINDS] = {
+    "client-idle", "upstream-connect", "first-byte", "body-progress", "tunnel-idle"
+};
+
+static uint64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void unlink_timer(Timer *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+    t->pending = 0;
+}
+
+// Put a timer in the level whose span covers its distance from next_tick;
+// called with wheel_mutex held
+static void place_timer(Timer *t) {
+    if (t->expires < next_tick) t->expires = next_tick;
+    uint64_t delta = t->expires - next_tick;
+    if (delta >= WHEEL_SPAN) {
+        t->expires = next_tick + WHEEL_SPAN - 1;
+        delta = WHEEL_SPAN - 1;
+    }
+
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (1ULL << (WHEEL_BITS * (level + 1)))) level++;
+    Timer *head = &wheel[level][(t->expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+    t->pending = 1;
+}
+
+// Move every timer in one slot of a higher level down to where it now belongs.
+// Returns the slot index so the caller knows whether this level wrapped too.
+static int cascade(int level) {
+    int index = (next_tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    Timer *head = &wheel[level][index];
+    Timer *t = head->next;
+    head->next = head->prev = head;
+    while (t != head) {
+        Timer *next = t->next;
+        place_timer(t);
+        t = next;
+    }
+    return index;
+}
+
+static void run_tick(void) {
+    int index = next_tick & WHEEL_MASK;
+    if (index == 0) {
+        for (int level = 1; level < WHEEL_LEVELS && cascade(level) == 0; level++) {
+        }
+    }
+    __atomic_store_n(&next_tick, next_tick + 1, __ATOMIC_RELAXED);
+
+    // Detach the due list first; callbacks may re-arm into the wheel
+    Timer *head = &wheel[0][index];
+    Timer due = { .next = head->next, .prev = head->prev };
+    if (due.next == head) return;
+    due.next->prev = &due;
+    due.prev->next = &due;
+    head->next = head->prev = head;
+
+    while (due.next != &due) {
+        Timer *t = due.next;
+        unlink_timer(t);
+        long again = t->fn(t);
+        if (again > 0) {
+            t->expires = next_tick + (again + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+            place_timer(t);
+        }
+    }
+}
+
+static void* wheel_thread_func(void *arg) {
+    while (1) {
+        usleep(TIMER_TICK_MS * 1000);
+        uint64_t now = (monotonic_ms() - start_ms) / TIMER_TICK_MS;
+        pthread_mutex_lock(&wheel_mutex);
+        while (next_tick <= now) run_tick();
+        pthread_mutex_unlock(&wheel_mutex);
+    }
+    return NULL;
+}
+
+// Report the counters once a second, and only when deadlines have fired
+// since the last report
+static long report_timeouts(Timer *t) {
+    unsigned long total = 0;
+    for (int k = 0; k < TIMEOUT_KINDS; k++) total += fired_counts[k];
+    if (total == reported_total) return REPORT_MS;
+    reported_total = total;
+
+    char message[256];
+    int n = snprintf(message, sizeof(message), "[TIMEOUT]");
+    for (int k = 0; k < TIMEOUT_KINDS && n < (int)sizeof(message); k++) {
+        n += snprintf(message + n, sizeof(message) - n, " %s=%lu", kind_names[k], fired_counts[k]);
+    }
+    printf("%s\n", message);
+    char *msg = strdup(message);
+    if (msg) g_idle_add(log_message_idle, msg);
+    return REPORT_MS;
+}
+
+static void start_wheel(void) {
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int i = 0; i < WHEEL_SLOTS; i++) {
+            wheel[level][i].next = wheel[level][i].prev = &wheel[level][i];
+        }
+    }
+    timeouts_ms[TIMEOUT_CLIENT_IDLE] = config_long("PROXY_TIMEOUT_CLIENT_IDLE_MS", 30000);
+    timeouts_ms[TIMEOUT_UPSTREAM_CONNECT] = config_long("PROXY_TIMEOUT_CONNECT_MS", 5000);
+    timeouts_ms[TIMEOUT_FIRST_BYTE] = config_long("PROXY_TIMEOUT_FIRST_BYTE_MS", 15000);
+    timeouts_ms[TIMEOUT_BODY_PROGRESS] = config_long("PROXY_TIMEOUT_BODY_PROGRESS_MS", 10000);
+    timeouts_ms[TIMEOUT_TUNNEL_IDLE] = config_long("PROXY_TIMEOUT_TUNNEL_IDLE_MS", 60000);
+    start_ms = monotonic_ms();
+
+    // Nothing else can reach the wheel until the once-routine returns
+    report_timer.fn = report_timeouts;
+    report_timer.expires = REPORT_MS / TIMER_TICK_MS;
+    place_timer(&report_timer);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, wheel_thread_func, NULL) == 0) {
+        pthread_detach(thread);
+    } else {
+        perror("[-] Unable to start timer thread");
+    }
+}
+
+void timer_init(void) {
+    pthread_once(&wheel_once, start_wheel);
+}
+
+void timer_add(Timer *t, long ms, long (*fn)(Timer *t)) {
+    pthread_once(&wheel_once, start_wheel);
+    pthread_mutex_lock(&wheel_mutex);
+    if (t->pending) unlink_timer(t);
+    t->fn = fn;
+    t->expires = next_tick + (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    place_timer(t);
+    pthread_mutex_unlock(&wheel_mutex);
+}
+
+// Once this returns the callback is neither running nor due to run
+void timer_cancel(Timer *t) {
+    pthread_mutex_lock(&wheel_mutex);
+    if (t->pending) unlink_timer(t);
+    pthread_mutex_unlock(&wheel_mutex);
+}
+
+// Fires once the connection has gone a full timeout without progress;
+// touches since arming just push the deadline out
+static long deadline_expired(Timer *t) {
+    Deadline *d = (Deadline *)t;
+    long timeout = timeouts_ms[d->kind];
+    long idle = (long)(next_tick - __atomic_load_n(&d->last_progress, __ATOMIC_RELAXED)) * TIMER_TICK_MS;
+    if (idle < timeout) return timeout - idle;
+
+    d->fired = 1;
+    fired_counts[d->kind]++;
+    for (int i = 0; i < 2; i++) {
+        if (d->fds[i] >= 0) shutdown(d->fds[i], SHUT_RDWR);
+    }
+    printf("[TIMEOUT] %s deadline fired after %ld ms (%lu so far)\n",
+           kind_names[d->kind], timeout, fired_counts[d->kind]);
+    return 0;
+}
+
+void deadline_init(Deadline *d) {
+    d->timer.next = d->timer.prev = NULL;
+    d->timer.pending = 0;
+    d->kind = TIMEOUT_CLIENT_IDLE;
+    d->fds[0] = d->fds[1] = -1;
+    d->last_progress = 0;
+    d->fired = 0;
+}
+
+// Start (or switch to) a deadline of the given kind covering fd and other_fd
+void deadline_arm(Deadline *d, TimeoutKind kind, int fd, int other_fd) {
+    pthread_once(&wheel_once, start_wheel);
+    pthread_mutex_lock(&wheel_mutex);
+    if (d->timer.pending) unlink_timer(&d->timer);
+    d->kind = kind;
+    d->fds[0] = fd;
+    d->fds[1] = other_fd;
+    d->fired = 0;
+    d->last_progress = next_tick;
+    d->timer.fn = deadline_expired;
+    d->timer.expires = next_tick + (timeouts_ms[kind] + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    place_timer(&d->timer);
+    pthread_mutex_unlock(&wheel_mutex);
+}
+
+// Point a running deadline at different sockets without restarting it.
+// Returns 1 if it has already fired, in which case nothing is covered.
+int deadline_cover(Deadline *d, int fd, int other_fd) {
+    pthread_mutex_lock(&wheel_mutex);
+    int fired = d->fired;
+    if (!fired) {
+        d->fds[0] = fd;
+        d->fds[1] = other_fd;
+    }
+    pthread_mutex_unlock(&wheel_mutex);
+    return fired;
+}
+
+// Record progress without taking the wheel lock
+void deadline_touch(Deadline *d) {
+    __atomic_store_n(&d->last_progress, __atomic_load_n(&next_tick, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+}
+
+// Stop the deadline; returns 1 if it fired. Must be called before the
+// covered sockets are closed so a late expiry cannot hit a reused fd.
+int deadline_disarm(Deadline *d) {
+    pthread_mutex_lock(&wheel_mutex);
+    if (d->timer.pending) unlink_timer(&d->timer);
+    int fired = d->fired;
+    d->fds[0] = d->fds[1] = -1;
+    pthread_mutex_unlock(&wheel_mutex);
+    return fired;
+}
@@ -0,0 +1,53 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+// Hierarchical timing wheel: four levels of 64 slots at a 10 ms tick, so
+// insert and cancel are O(1) list operations and one thread drives every
+// timer in the process. Callbacks run on that thread with the wheel locked;
+// they must be short and may return a delay in ms to re-arm themselves.
+typedef struct Timer {
+    struct Timer *next, *prev;
+    uint64_t expires;           // in ticks
+    long (*fn)(struct Timer *t);
+    int pending;
+} Timer;
+
+void timer_init(void);
+void timer_add(Timer *t, long ms, long (*fn)(Timer *t));
+void timer_cancel(Timer *t);
+
+// Per-connection deadlines. When one fires, the sockets it covers are shut
+// down, which wakes any thread blocked in connect, recv, send or select on
+// them. Per-kind counts are logged once a second while deadlines are
+// firing. Timeouts come from the environment:
+//   PROXY_TIMEOUT_CLIENT_IDLE_MS     request headers, request body, cache hits (30000)
+//   PROXY_TIMEOUT_CONNECT_MS         name resolution plus upstream connect (5000)
+//   PROXY_TIMEOUT_FIRST_BYTE_MS      request sent to first response byte (15000)
+//   PROXY_TIMEOUT_BODY_PROGRESS_MS   gap between response bytes (10000)
+//   PROXY_TIMEOUT_TUNNEL_IDLE_MS     CONNECT tunnel with no traffic (60000)
+typedef enum {
+    TIMEOUT_CLIENT_IDLE,
+    TIMEOUT_UPSTREAM_CONNECT,
+    TIMEOUT_FIRST_BYTE,
+    TIMEOUT_BODY_PROGRESS,
+    TIMEOUT_TUNNEL_IDLE,
+    TIMEOUT_KINDS
+} TimeoutKind;
+
+typedef struct {
+    Timer timer;
+    TimeoutKind kind;
+    int fds[2];
+    uint64_t last_progress;     // tick of the last deadline_touch
+    int fired;
+} Deadline;
+
+void deadline_init(Deadline *d);
+void deadline_arm(Deadline *d, TimeoutKind kind, int fd, int other_fd);
+int deadline_cover(Deadline *d, int fd, int other_fd);
+void deadline_touch(Deadline *d);
+int deadline_disarm(Deadline *d);
+
+#endif